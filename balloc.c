@@ -0,0 +1,946 @@
+/*
+ * balloc.c
+ *
+ * 2021 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/blkdev.h>
+#include <linux/wait_bit.h>
+
+#include "vsfs_fs.h"
+#include "vsfs.h"
+
+/*
+ * Reservation windows, after ext2.
+ *
+ * Every window lives in sbi->rsv_window_root, sorted by start; windows
+ * never overlap and never cross a group.  A window that got more than half
+ * used before it ran out is followed by one twice its size, so a file that
+ * keeps appending ends up taking long stretches of the disk at a time.
+ */
+static inline int vsfs_rsv_is_empty(struct vsfs_reserve_window *rsv)
+{
+	return RB_EMPTY_NODE(&rsv->rsv_node);
+}
+
+/* first window that ends at or after @blk */
+static struct vsfs_reserve_window *vsfs_search_window(struct rb_root *root, unsigned int blk)
+{
+	struct rb_node *n = root->rb_node;
+	struct vsfs_reserve_window *rsv, *found = NULL;
+
+	while (n) {
+		rsv = rb_entry(n, struct vsfs_reserve_window, rsv_node);
+		if (rsv->rsv_end >= blk) {
+			found = rsv;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+	return found;
+}
+
+static void vsfs_rsv_window_add(struct rb_root *root, struct vsfs_reserve_window *rsv)
+{
+	struct rb_node **p = &root->rb_node;
+	struct rb_node *parent = NULL;
+	struct vsfs_reserve_window *this;
+
+	while (*p) {
+		parent = *p;
+		this = rb_entry(parent, struct vsfs_reserve_window, rsv_node);
+		if (rsv->rsv_start < this->rsv_start)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&rsv->rsv_node, parent, p);
+	rb_insert_color(&rsv->rsv_node, root);
+}
+
+static void vsfs_rsv_window_remove(struct vsfs_sb_info *sbi, struct vsfs_reserve_window *rsv)
+{
+	if (vsfs_rsv_is_empty(rsv))
+		return;
+	rb_erase(&rsv->rsv_node, &sbi->rsv_window_root);
+	RB_CLEAR_NODE(&rsv->rsv_node);
+}
+
+void vsfs_discard_reservation(struct inode *inode)
+{
+	struct vsfs_sb_info *sbi = VSFS_SB(inode->i_sb);
+	struct vsfs_reserve_window *rsv = &VSFS_I(inode)->i_rsv_window;
+
+	spin_lock(&sbi->rsv_window_lock);
+	vsfs_rsv_window_remove(sbi, rsv);
+	spin_unlock(&sbi->rsv_window_lock);
+}
+
+/*
+ * Move @rsv to the first free bit at or after @grp_goal in group @g that
+ * starts a range no other window claims.  Called with the group locked.
+ */
+static int vsfs_alloc_new_window(struct vsfs_sb_info *sbi, struct vsfs_reserve_window *rsv,
+		unsigned int g, void *bitmap, unsigned int grp_goal, unsigned int bits)
+{
+	struct vsfs_reserve_window *next;
+	unsigned int base = sbi->data_blkaddr + g * VSFS_BITS_PER_BLK;
+	unsigned int size = rsv->rsv_goal_size;
+	unsigned int bno, start, end;
+
+	if (!vsfs_rsv_is_empty(rsv) && rsv->rsv_alloc_hit > size / 2)
+		size = min(size * 2, (unsigned int)VSFS_MAX_RESERVE_BLOCKS);
+	rsv->rsv_goal_size = size;
+
+	spin_lock(&sbi->rsv_window_lock);
+	vsfs_rsv_window_remove(sbi, rsv);
+	while (1) {
+		bno = find_next_zero_bit_le(bitmap, bits, grp_goal);
+		if (bno >= bits)
+			goto no_window;
+		start = base + bno;
+		end = base + min(bno + size, bits) - 1;
+
+		next = vsfs_search_window(&sbi->rsv_window_root, start);
+		if (!next || next->rsv_start > end)
+			break;
+		grp_goal = next->rsv_end + 1 - base;
+	}
+	rsv->rsv_start = start;
+	rsv->rsv_end = end;
+	rsv->rsv_alloc_hit = 0;
+	vsfs_rsv_window_add(&sbi->rsv_window_root, rsv);
+	spin_unlock(&sbi->rsv_window_lock);
+	return 0;
+
+no_window:
+	spin_unlock(&sbi->rsv_window_lock);
+	return -ENOSPC;
+}
+
+/*
+ * Free extent index.
+ *
+ * Each group can carry the free runs of its data bitmap as extents in two
+ * rbtrees, one by start for next-fit and one by length for best-fit, so a
+ * multi-block request finds a run that fits without walking the bitmap.
+ * The index is built from the bitmap the first time a group is allocated
+ * from and changes together with it under the group lock.  It is only a
+ * cache: when a node cannot be allocated the group drops its index and
+ * goes back to scanning until the next build.
+ */
+static struct kmem_cache *vsfs_fext_cachep;
+
+static inline unsigned int vsfs_fext_end(struct vsfs_free_extent *fe)
+{
+	return fe->fe_start + fe->fe_len;
+}
+
+static void vsfs_fext_insert_size(struct vsfs_group_info *grp, struct vsfs_free_extent *fe)
+{
+	struct rb_node **p = &grp->fext_by_size.rb_node;
+	struct rb_node *parent = NULL;
+	struct vsfs_free_extent *this;
+
+	while (*p) {
+		parent = *p;
+		this = rb_entry(parent, struct vsfs_free_extent, fe_size_node);
+		if (fe->fe_len < this->fe_len ||
+				(fe->fe_len == this->fe_len && fe->fe_start < this->fe_start))
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&fe->fe_size_node, parent, p);
+	rb_insert_color(&fe->fe_size_node, &grp->fext_by_size);
+}
+
+static void vsfs_fext_insert(struct vsfs_group_info *grp, struct vsfs_free_extent *fe)
+{
+	struct rb_node **p = &grp->fext_by_start.rb_node;
+	struct rb_node *parent = NULL;
+	struct vsfs_free_extent *this;
+
+	while (*p) {
+		parent = *p;
+		this = rb_entry(parent, struct vsfs_free_extent, fe_node);
+		if (fe->fe_start < this->fe_start)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&fe->fe_node, parent, p);
+	rb_insert_color(&fe->fe_node, &grp->fext_by_start);
+	vsfs_fext_insert_size(grp, fe);
+}
+
+static void vsfs_fext_erase(struct vsfs_group_info *grp, struct vsfs_free_extent *fe)
+{
+	rb_erase(&fe->fe_node, &grp->fext_by_start);
+	rb_erase(&fe->fe_size_node, &grp->fext_by_size);
+	kmem_cache_free(vsfs_fext_cachep, fe);
+}
+
+/* the length is the size tree's key, so re-sort after changing it */
+static void vsfs_fext_resize(struct vsfs_group_info *grp, struct vsfs_free_extent *fe,
+		unsigned int start, unsigned int len)
+{
+	rb_erase(&fe->fe_size_node, &grp->fext_by_size);
+	fe->fe_start = start;
+	fe->fe_len = len;
+	vsfs_fext_insert_size(grp, fe);
+}
+
+static struct vsfs_free_extent *vsfs_fext_new(unsigned int start, unsigned int len)
+{
+	struct vsfs_free_extent *fe;
+
+	fe = kmem_cache_alloc(vsfs_fext_cachep, GFP_NOWAIT | __GFP_NOWARN);
+	if (fe) {
+		fe->fe_start = start;
+		fe->fe_len = len;
+	}
+	return fe;
+}
+
+static void vsfs_fext_destroy(struct vsfs_group_info *grp)
+{
+	struct vsfs_free_extent *fe, *next;
+
+	rbtree_postorder_for_each_entry_safe(fe, next, &grp->fext_by_start, fe_node)
+		kmem_cache_free(vsfs_fext_cachep, fe);
+	grp->fext_by_start = RB_ROOT;
+	grp->fext_by_size = RB_ROOT;
+	clear_bit(VSFS_GRP_FEXT_BUILT, &grp->state);
+}
+
+/* build the index of a group from its bitmap, with the group locked */
+static bool vsfs_fext_ready(struct vsfs_group_info *grp, void *bitmap, unsigned int bits)
+{
+	struct vsfs_free_extent *fe;
+	unsigned int start, end;
+
+	if (test_bit(VSFS_GRP_FEXT_BUILT, &grp->state))
+		return true;
+
+	start = find_next_zero_bit_le(bitmap, bits, 0);
+	while (start < bits) {
+		end = find_next_bit_le(bitmap, bits, start);
+		fe = vsfs_fext_new(start, end - start);
+		if (!fe) {
+			vsfs_fext_destroy(grp);
+			return false;
+		}
+		vsfs_fext_insert(grp, fe);
+		start = find_next_zero_bit_le(bitmap, bits, end);
+	}
+	set_bit(VSFS_GRP_FEXT_BUILT, &grp->state);
+	return true;
+}
+
+/* next-fit: the first free extent that ends past @bit */
+static struct vsfs_free_extent *vsfs_fext_next(struct vsfs_group_info *grp, unsigned int bit)
+{
+	struct rb_node *n = grp->fext_by_start.rb_node;
+	struct vsfs_free_extent *fe, *found = NULL;
+
+	while (n) {
+		fe = rb_entry(n, struct vsfs_free_extent, fe_node);
+		if (vsfs_fext_end(fe) > bit) {
+			found = fe;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+	return found;
+}
+
+/* best-fit: the smallest free extent of at least @len bits */
+static struct vsfs_free_extent *vsfs_fext_best(struct vsfs_group_info *grp, unsigned int len)
+{
+	struct rb_node *n = grp->fext_by_size.rb_node;
+	struct vsfs_free_extent *fe, *found = NULL;
+
+	while (n) {
+		fe = rb_entry(n, struct vsfs_free_extent, fe_size_node);
+		if (fe->fe_len >= len) {
+			found = fe;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+	return found;
+}
+
+/* take [@start, @start + @len) out of the free extent holding it */
+static int vsfs_fext_use(struct vsfs_group_info *grp, unsigned int start, unsigned int len)
+{
+	struct vsfs_free_extent *fe, *right;
+	unsigned int end = start + len;
+
+	fe = vsfs_fext_next(grp, start);
+	if (!fe || fe->fe_start > start || vsfs_fext_end(fe) < end)
+		return -EINVAL;
+
+	if (fe->fe_start == start && vsfs_fext_end(fe) == end) {
+		vsfs_fext_erase(grp, fe);
+	} else if (fe->fe_start == start) {
+		vsfs_fext_resize(grp, fe, end, vsfs_fext_end(fe) - end);
+	} else if (vsfs_fext_end(fe) == end) {
+		vsfs_fext_resize(grp, fe, fe->fe_start, start - fe->fe_start);
+	} else {
+		right = vsfs_fext_new(end, vsfs_fext_end(fe) - end);
+		if (!right)
+			return -ENOMEM;
+		vsfs_fext_resize(grp, fe, fe->fe_start, start - fe->fe_start);
+		vsfs_fext_insert(grp, right);
+	}
+	return 0;
+}
+
+/* give [@start, @start + @len) back, merging with the neighbours */
+static int vsfs_fext_free(struct vsfs_group_info *grp, unsigned int start, unsigned int len)
+{
+	struct vsfs_free_extent *prev = NULL, *next, *fe;
+	struct rb_node *n;
+	unsigned int end = start + len;
+
+	next = vsfs_fext_next(grp, start);
+	if (next && next->fe_start < end)
+		return -EINVAL;
+	if (next) {
+		n = rb_prev(&next->fe_node);
+		prev = n ? rb_entry(n, struct vsfs_free_extent, fe_node) : NULL;
+	} else if ((n = rb_last(&grp->fext_by_start))) {
+		prev = rb_entry(n, struct vsfs_free_extent, fe_node);
+	}
+
+	if (prev && vsfs_fext_end(prev) == start) {
+		if (next && next->fe_start == end) {
+			end = vsfs_fext_end(next);
+			vsfs_fext_erase(grp, next);
+		}
+		vsfs_fext_resize(grp, prev, prev->fe_start, end - prev->fe_start);
+	} else if (next && next->fe_start == end) {
+		vsfs_fext_resize(grp, next, start, vsfs_fext_end(next) - start);
+	} else {
+		fe = vsfs_fext_new(start, len);
+		if (!fe)
+			return -ENOMEM;
+		vsfs_fext_insert(grp, fe);
+	}
+	return 0;
+}
+
+/*
+ * Where to put up to @count blocks, using the index: inside the free
+ * extent holding the goal so a file keeps growing in place, otherwise for
+ * several blocks the smallest extent that takes them all (or the largest
+ * there is), and for one block the next extent past the goal.
+ */
+static int vsfs_fext_find(struct vsfs_group_info *grp, unsigned int grp_goal,
+		unsigned long count, unsigned long *num)
+{
+	struct vsfs_free_extent *fe, *best;
+	struct rb_node *n;
+
+	fe = vsfs_fext_next(grp, grp_goal);
+	if (fe && fe->fe_start <= grp_goal) {
+		*num = min_t(unsigned long, count, vsfs_fext_end(fe) - grp_goal);
+		return grp_goal;
+	}
+
+	if (count > 1) {
+		best = vsfs_fext_best(grp, count);
+		if (!best && (n = rb_last(&grp->fext_by_size)))
+			best = rb_entry(n, struct vsfs_free_extent, fe_size_node);
+		if (best)
+			fe = best;
+	} else if (!fe && (n = rb_first(&grp->fext_by_start))) {
+		fe = rb_entry(n, struct vsfs_free_extent, fe_node);
+	}
+	if (!fe)
+		return -1;
+
+	*num = min_t(unsigned long, count, fe->fe_len);
+	return fe->fe_start;
+}
+
+/* set @len bits from @bit on, whole bytes at a time where aligned */
+static void vsfs_set_bits_le(void *bitmap, unsigned int bit, unsigned int len)
+{
+	unsigned int end = bit + len, n;
+
+	while (bit < end) {
+		if (!(bit & 7) && bit + 8 <= end) {
+			n = (end - bit) >> 3;
+			memset(bitmap + (bit >> 3), 0xff, n);
+			bit += n << 3;
+			continue;
+		}
+		__set_bit_le(bit++, bitmap);
+	}
+}
+
+/* mark a run allocated in the bitmap and, if the group has one, the index */
+static void vsfs_mark_used(struct vsfs_group_info *grp, void *bitmap, unsigned int bno, unsigned int num)
+{
+	vsfs_set_bits_le(bitmap, bno, num);
+	if (test_bit(VSFS_GRP_FEXT_BUILT, &grp->state) && vsfs_fext_use(grp, bno, num))
+		vsfs_fext_destroy(grp);
+}
+
+/* take the free run at or after @from, up to *@count bits and below @end */
+static int vsfs_take_bits(struct vsfs_group_info *grp, void *bitmap, unsigned int from,
+		unsigned int end, unsigned long *count)
+{
+	struct vsfs_free_extent *fe;
+	unsigned long num;
+	unsigned int bno;
+
+	if (test_bit(VSFS_GRP_FEXT_BUILT, &grp->state)) {
+		fe = vsfs_fext_next(grp, from);
+		if (!fe || fe->fe_start >= end)
+			return -1;
+		bno = max(fe->fe_start, from);
+		num = min3(*count, (unsigned long)(vsfs_fext_end(fe) - bno),
+				(unsigned long)(end - bno));
+	} else {
+		bno = find_next_zero_bit_le(bitmap, end, from);
+		if (bno >= end)
+			return -1;
+
+		/* grow the run while the following bits are free too */
+		num = 1;
+		while (num < *count && bno + num < end && !test_bit_le(bno + num, bitmap))
+			num++;
+	}
+
+	vsfs_mark_used(grp, bitmap, bno, num);
+	*count = num;
+	return bno;
+}
+
+/*
+ * Allocate in group @g, from @rsv when there is one: the window is kept if
+ * it holds the goal and still has free blocks, and replaced by a new one
+ * otherwise.  Called with the group locked.
+ */
+static int vsfs_alloc_in_group(struct vsfs_sb_info *sbi, struct vsfs_reserve_window *rsv,
+		unsigned int g, void *bitmap, unsigned int grp_goal, unsigned long *count)
+{
+	struct vsfs_group_info *grp = vsfs_get_group(sbi, g);
+	unsigned int base = sbi->data_blkaddr + g * VSFS_BITS_PER_BLK;
+	unsigned int bits = vsfs_group_data_bits(sbi, g);
+	unsigned long num;
+	int bno, tries;
+
+	if (!rsv) {
+		if (vsfs_fext_ready(grp, bitmap, bits)) {
+			bno = vsfs_fext_find(grp, grp_goal, *count, &num);
+			if (bno < 0)
+				return -1;
+			vsfs_mark_used(grp, bitmap, bno, num);
+			*count = num;
+			return bno;
+		}
+		return vsfs_take_bits(grp, bitmap, grp_goal, bits, count);
+	}
+
+	vsfs_fext_ready(grp, bitmap, bits);
+	if (vsfs_rsv_is_empty(rsv) || base + grp_goal < rsv->rsv_start ||
+			base + grp_goal > rsv->rsv_end) {
+		if (vsfs_alloc_new_window(sbi, rsv, g, bitmap, grp_goal, bits))
+			return -1;
+	}
+
+	for (tries = 0; tries < 2; tries++) {
+		num = *count;
+		bno = vsfs_take_bits(grp, bitmap, max(grp_goal, rsv->rsv_start - base),
+				rsv->rsv_end - base + 1, &num);
+		if (bno >= 0) {
+			rsv->rsv_alloc_hit += num;
+			*count = num;
+			return bno;
+		}
+		/* the window is used up, open the next one behind it */
+		grp_goal = rsv->rsv_end - base + 1;
+		if (vsfs_alloc_new_window(sbi, rsv, g, bitmap, grp_goal, bits))
+			return -1;
+	}
+	return -1;
+}
+
+/*
+ * Take up to *@count contiguous free data blocks and return the first one;
+ * *@count is trimmed to what was actually taken.  The search starts at
+ * @goal, or when there is none at the bit the previous allocation stopped
+ * at, and skips every group the free counts say is full, so a mostly
+ * allocated volume costs one bitmap read per block.  A run never spans two
+ * groups.  With @rsv the blocks come out of that reservation window; if
+ * no group has room for a window, it is dropped and we allocate without.
+ */
+unsigned int vsfs_new_blocks(struct super_block *sb, struct vsfs_reserve_window *rsv,
+		unsigned int goal, unsigned long *count, int *err)
+{
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+	struct vsfs_reserve_window *grp_rsv;
+	struct vsfs_group_info *grp;
+	struct buffer_head *bitmap_bh;
+	unsigned int g, n, start;
+	unsigned long num;
+	int pass, bno;
+
+	if (goal >= sbi->data_blkaddr && goal - sbi->data_blkaddr < sbi->blkcnt_data)
+		start = goal - sbi->data_blkaddr;
+	else
+		start = READ_ONCE(sbi->dmap_start_lookup);
+	if (start >= sbi->blkcnt_data)
+		start = 0;
+
+retry:
+	/*
+	 * The first pass skips groups somebody else is allocating from, so
+	 * concurrent writers spread over the groups instead of queueing on
+	 * one bitmap.  The second pass waits for the lock.  The goal group
+	 * is always waited for, the lock is only held for a few bit tests.
+	 */
+	for (pass = 0; pass < 2; pass++) {
+		for (n = 0; n <= sbi->group_count; n++) {
+			g = start / VSFS_BITS_PER_BLK + n;
+			if (g >= sbi->group_count)
+				g -= sbi->group_count;
+			grp = vsfs_get_group(sbi, g);
+			if (!READ_ONCE(grp->free_blocks))
+				continue;
+
+			/* a group about to run out is no place for a window */
+			grp_rsv = rsv;
+			if (rsv && READ_ONCE(grp->free_blocks) < rsv->rsv_goal_size)
+				grp_rsv = NULL;
+
+retry_group:
+			bitmap_bh = sb_bread(sb, sbi->dmap_blkaddr + g);
+			if (!bitmap_bh) {
+				*err = -EIO;
+				return 0;
+			}
+
+			if (!pass && n) {
+				if (!spin_trylock(&grp->lock)) {
+					brelse(bitmap_bh);
+					continue;
+				}
+			} else {
+				spin_lock(&grp->lock);
+			}
+
+			/* FITRIM is discarding the free runs of this group */
+			if (test_bit(VSFS_GRP_TRIMMING, &grp->state)) {
+				spin_unlock(&grp->lock);
+				brelse(bitmap_bh);
+				if (!pass && n)
+					continue;
+				wait_on_bit(&grp->state, VSFS_GRP_TRIMMING, TASK_UNINTERRUPTIBLE);
+				goto retry_group;
+			}
+
+			/* only the first group visited resumes mid-bitmap */
+			num = *count;
+			bno = vsfs_alloc_in_group(sbi, grp_rsv, g, bitmap_bh->b_data,
+					n ? 0 : start % VSFS_BITS_PER_BLK, &num);
+			if (bno < 0) {
+				spin_unlock(&grp->lock);
+				brelse(bitmap_bh);
+				continue;
+			}
+			grp->free_blocks -= num;
+			spin_unlock(&grp->lock);
+
+			percpu_counter_sub(&sbi->free_blocks_counter, num);
+			WRITE_ONCE(sbi->dmap_start_lookup, g * VSFS_BITS_PER_BLK + bno + num);
+
+			mark_buffer_dirty(bitmap_bh);
+			set_bit(VSFS_GRP_DMAP_DIRTY, &grp->state);
+			if (sb->s_flags & SB_SYNCHRONOUS)
+				sync_dirty_buffer(bitmap_bh);
+			brelse(bitmap_bh);
+
+			*count = num;
+			*err = 0;
+			return VSFS_GET_SB(data_blkaddr) + g * VSFS_BITS_PER_BLK + bno;
+		}
+	}
+
+	if (rsv) {
+		spin_lock(&sbi->rsv_window_lock);
+		vsfs_rsv_window_remove(sbi, rsv);
+		spin_unlock(&sbi->rsv_window_lock);
+		rsv = NULL;
+		goto retry;
+	}
+
+	*err = -ENOSPC;
+	return 0;
+}
+
+/*
+ * Blocks nobody has a claim on: free in the bitmap and not promised to a
+ * delayed allocation.  The cheap per-cpu reads are only trusted while we
+ * are far enough from running out.
+ */
+unsigned long vsfs_count_free_blocks(struct super_block *sb)
+{
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+	s64 free, dirty;
+
+	free = percpu_counter_read_positive(&sbi->free_blocks_counter);
+	dirty = percpu_counter_read_positive(&sbi->dirty_blocks_counter);
+	if (free - dirty < VSFS_FREEBLOCKS_WATERMARK) {
+		free = percpu_counter_sum_positive(&sbi->free_blocks_counter);
+		dirty = percpu_counter_sum_positive(&sbi->dirty_blocks_counter);
+	}
+
+	return free > dirty ? free - dirty : 0;
+}
+
+int vsfs_reserve_blocks(struct super_block *sb, unsigned long count)
+{
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+
+	if (vsfs_count_free_blocks(sb) < count)
+		return -ENOSPC;
+	percpu_counter_add(&sbi->dirty_blocks_counter, count);
+	return 0;
+}
+
+void vsfs_release_blocks(struct super_block *sb, unsigned long count)
+{
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+
+	percpu_counter_sub(&sbi->dirty_blocks_counter, count);
+}
+
+/* clear @len bits from @bit on, whole bytes at a time where aligned */
+static void vsfs_clear_bits_le(void *bitmap, unsigned int bit, unsigned int len)
+{
+	unsigned int end = bit + len, n;
+
+	while (bit < end) {
+		if (!(bit & 7) && bit + 8 <= end) {
+			n = (end - bit) >> 3;
+			memset(bitmap + (bit >> 3), 0, n);
+			bit += n << 3;
+			continue;
+		}
+		__clear_bit_le(bit++, bitmap);
+	}
+}
+
+static int vsfs_queue_discard(struct super_block *, unsigned int, unsigned int);
+
+/* write back and drop the bitmap block the batch is holding */
+static void vsfs_free_batch_flush(struct vsfs_free_batch *batch)
+{
+	struct super_block *sb = batch->sb;
+
+	if (!batch->bitmap_bh)
+		return;
+	mark_buffer_dirty(batch->bitmap_bh);
+	set_bit(VSFS_GRP_DMAP_DIRTY, &vsfs_get_group(VSFS_SB(sb), batch->group)->state);
+	if (sb->s_flags & SB_SYNCHRONOUS)
+		sync_dirty_buffer(batch->bitmap_bh);
+	brelse(batch->bitmap_bh);
+	batch->bitmap_bh = NULL;
+}
+
+/* @inode, if any, is who gets the freed blocks taken off i_blocks */
+void vsfs_free_batch_init(struct vsfs_free_batch *batch, struct super_block *sb, struct inode *inode)
+{
+	batch->sb = sb;
+	batch->inode = inode;
+	batch->bitmap_bh = NULL;
+	batch->group = 0;
+	batch->freed = 0;
+}
+
+/*
+ * Give @count blocks from @block on back to the data bitmap.  The bitmap
+ * block stays with the batch until a run in another group comes along or
+ * the batch ends, so freeing a whole file dirties each bitmap block it
+ * touches once.  With -o discard a file's blocks go to the discard queue
+ * instead and reach the bitmap once they have been discarded.
+ */
+void vsfs_free_batch_add(struct vsfs_free_batch *batch, unsigned int block, unsigned int count)
+{
+	struct super_block *sb = batch->sb;
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+	struct vsfs_group_info *grp;
+	unsigned int bit, g, bno, num, freed;
+
+	if (block < sbi->data_blkaddr || count > sbi->blkcnt_data ||
+			block - sbi->data_blkaddr > sbi->blkcnt_data - count) {
+		vsfs_msg(KERN_ERR, "vsfs_free_blocks", "Freeing blocks not in datazone - "
+				"block = %u, count = %u", block, count);
+		return;
+	}
+
+	if (batch->inode && test_opt(sb, DISCARD) && !vsfs_queue_discard(sb, block, count)) {
+		batch->freed += count;
+		return;
+	}
+
+	bit = block - sbi->data_blkaddr;
+	while (count) {
+		g = bit / VSFS_BITS_PER_BLK;
+		bno = bit % VSFS_BITS_PER_BLK;
+		num = min(count, VSFS_BITS_PER_BLK - bno);
+
+		if (!batch->bitmap_bh || batch->group != g) {
+			vsfs_free_batch_flush(batch);
+			batch->bitmap_bh = sb_bread(sb, sbi->dmap_blkaddr + g);
+			if (!batch->bitmap_bh) {
+				vsfs_msg(KERN_ERR, "vsfs_free_blocks", "Failed to read data bitmap of group %u", g);
+				return;
+			}
+			batch->group = g;
+		}
+
+		grp = vsfs_get_group(sbi, g);
+		spin_lock(&grp->lock);
+		if (find_next_zero_bit_le(batch->bitmap_bh->b_data, bno + num, bno) < bno + num) {
+			/* somebody freed part of this already, only count what we clear */
+			unsigned int i;
+
+			for (freed = 0, i = bno; i < bno + num; i++)
+				if (__test_and_clear_bit_le(i, batch->bitmap_bh->b_data))
+					freed++;
+			vsfs_msg(KERN_ERR, "vsfs_free_blocks", "Bit already cleared for block %u",
+					sbi->data_blkaddr + g * VSFS_BITS_PER_BLK + bno);
+			if (test_bit(VSFS_GRP_FEXT_BUILT, &grp->state))
+				vsfs_fext_destroy(grp);
+		} else {
+			vsfs_clear_bits_le(batch->bitmap_bh->b_data, bno, num);
+			freed = num;
+			if (test_bit(VSFS_GRP_FEXT_BUILT, &grp->state) && vsfs_fext_free(grp, bno, num))
+				vsfs_fext_destroy(grp);
+		}
+		grp->free_blocks += freed;
+		spin_unlock(&grp->lock);
+
+		percpu_counter_add(&sbi->free_blocks_counter, freed);
+		batch->freed += freed;
+		bit += num;
+		count -= num;
+	}
+}
+
+void vsfs_free_batch_end(struct vsfs_free_batch *batch)
+{
+	vsfs_free_batch_flush(batch);
+	if (batch->inode && batch->freed)
+		inode_sub_bytes(batch->inode, (loff_t)batch->freed << VSFS_BLKSHIFT);
+	batch->freed = 0;
+}
+
+void vsfs_free_blocks(struct inode *inode, unsigned int block, unsigned int count)
+{
+	struct vsfs_free_batch batch;
+
+	vsfs_free_batch_init(&batch, inode->i_sb, inode);
+	vsfs_free_batch_add(&batch, block, count);
+	vsfs_free_batch_end(&batch);
+}
+
+/*
+ * Discard queue for -o discard.
+ *
+ * Freed extents are queued instead of cleared in the bitmap, so nobody
+ * can reuse a block before its discard has gone out.  A worker picks the
+ * queue up a little later, which batches the discards of many unlinks
+ * and keeps them out of unlink itself.  Until then the queued blocks
+ * still count as used.
+ */
+static int vsfs_queue_discard(struct super_block *sb, unsigned int block, unsigned int count)
+{
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+	struct vsfs_discard_extent *de, *last;
+
+	spin_lock(&sbi->discard_lock);
+	if (!list_empty(&sbi->discard_list)) {
+		last = list_last_entry(&sbi->discard_list, struct vsfs_discard_extent, list);
+		if (last->start + last->len == block) {
+			last->len += count;
+			goto queued;
+		}
+	}
+	spin_unlock(&sbi->discard_lock);
+
+	de = kmalloc(sizeof(*de), GFP_NOFS);
+	if (!de)
+		return -ENOMEM;
+	de->start = block;
+	de->len = count;
+
+	spin_lock(&sbi->discard_lock);
+	list_add_tail(&de->list, &sbi->discard_list);
+queued:
+	spin_unlock(&sbi->discard_lock);
+	schedule_delayed_work(&sbi->discard_work, VSFS_DISCARD_DELAY);
+	return 0;
+}
+
+void vsfs_discard_worker(struct work_struct *work)
+{
+	struct vsfs_sb_info *sbi = container_of(to_delayed_work(work),
+			struct vsfs_sb_info, discard_work);
+	struct super_block *sb = sbi->sb;
+	struct vsfs_discard_extent *de, *tmp;
+	struct vsfs_free_batch batch;
+	LIST_HEAD(list);
+
+	spin_lock(&sbi->discard_lock);
+	list_splice_init(&sbi->discard_list, &list);
+	spin_unlock(&sbi->discard_lock);
+
+	vsfs_free_batch_init(&batch, sb, NULL);
+	list_for_each_entry_safe(de, tmp, &list, list) {
+		sb_issue_discard(sb, de->start, de->len, GFP_NOFS, 0);
+		vsfs_free_batch_add(&batch, de->start, de->len);
+		list_del(&de->list);
+		kfree(de);
+	}
+	vsfs_free_batch_end(&batch);
+}
+
+/* run the discard queue now; true if there was anything in it */
+bool vsfs_flush_discards(struct super_block *sb)
+{
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+	bool pending;
+
+	spin_lock(&sbi->discard_lock);
+	pending = !list_empty(&sbi->discard_list);
+	spin_unlock(&sbi->discard_lock);
+
+	if (pending) {
+		mod_delayed_work(system_wq, &sbi->discard_work, 0);
+		flush_delayed_work(&sbi->discard_work);
+	}
+	return pending;
+}
+
+/*
+ * FITRIM: discard every free run of at least @range->minlen blocks in the
+ * range.  While a group's runs are being discarded the allocator stays
+ * out of the group, so nothing gets written to a block we are about to
+ * discard; frees may still come in and are simply left for next time.
+ * On return @range->len is the number of bytes discarded.
+ */
+int vsfs_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+	struct vsfs_group_info *grp;
+	struct buffer_head *bitmap_bh;
+	u64 start, end, minlen, trimmed = 0;
+	unsigned int g, from, to, bno, next;
+	int ret = 0;
+
+	start = range->start >> VSFS_BLKSHIFT;
+	end = start + (range->len >> VSFS_BLKSHIFT) - 1;
+	minlen = max_t(u64, range->minlen >> VSFS_BLKSHIFT, 1);
+
+	if (minlen > VSFS_BITS_PER_BLK || start >= sbi->total_blkcnt ||
+			range->len < VSFS_BLKSIZE)
+		return -EINVAL;
+	if (end < start || end >= sbi->total_blkcnt)
+		end = sbi->total_blkcnt - 1;
+	if (end < sbi->data_blkaddr)
+		goto out;
+
+	/* from here on bit numbers in the data bitmap */
+	start = start > sbi->data_blkaddr ? start - sbi->data_blkaddr : 0;
+	end = min_t(u64, end - sbi->data_blkaddr, sbi->blkcnt_data - 1);
+	if (start > end)
+		goto out;
+
+	for (g = start / VSFS_BITS_PER_BLK; g <= end / VSFS_BITS_PER_BLK; g++) {
+		grp = vsfs_get_group(sbi, g);
+		if (READ_ONCE(grp->free_blocks) < minlen)
+			continue;
+
+		from = g == start / VSFS_BITS_PER_BLK ? start % VSFS_BITS_PER_BLK : 0;
+		to = g == end / VSFS_BITS_PER_BLK ? end % VSFS_BITS_PER_BLK + 1 :
+				vsfs_group_data_bits(sbi, g);
+
+		bitmap_bh = sb_bread(sb, sbi->dmap_blkaddr + g);
+		if (!bitmap_bh) {
+			ret = -EIO;
+			break;
+		}
+
+		spin_lock(&grp->lock);
+		set_bit(VSFS_GRP_TRIMMING, &grp->state);
+		spin_unlock(&grp->lock);
+
+		bno = find_next_zero_bit_le(bitmap_bh->b_data, to, from);
+		while (bno < to) {
+			next = find_next_bit_le(bitmap_bh->b_data, to, bno);
+			if (next - bno >= minlen) {
+				ret = sb_issue_discard(sb, sbi->data_blkaddr + g * VSFS_BITS_PER_BLK + bno,
+						next - bno, GFP_NOFS, 0);
+				if (ret)
+					break;
+				trimmed += next - bno;
+			}
+			if (fatal_signal_pending(current)) {
+				ret = -ERESTARTSYS;
+				break;
+			}
+			bno = find_next_zero_bit_le(bitmap_bh->b_data, to, next);
+		}
+
+		clear_bit_unlock(VSFS_GRP_TRIMMING, &grp->state);
+		smp_mb__after_atomic();
+		wake_up_bit(&grp->state, VSFS_GRP_TRIMMING);
+		brelse(bitmap_bh);
+		if (ret)
+			break;
+		cond_resched();
+	}
+
+out:
+	range->len = trimmed << VSFS_BLKSHIFT;
+	return ret;
+}
+
+/* drop the free extent indexes of every group, at unmount */
+void vsfs_drop_free_extents(struct vsfs_sb_info *sbi)
+{
+	unsigned int g;
+
+	for (g = 0; g < sbi->group_count; g++)
+		vsfs_fext_destroy(vsfs_get_group(sbi, g));
+}
+
+int __init vsfs_init_fext_cache(void)
+{
+	vsfs_fext_cachep = kmem_cache_create("vsfs_free_extent",
+				sizeof(struct vsfs_free_extent), 0,
+				SLAB_RECLAIM_ACCOUNT, NULL);
+	if (vsfs_fext_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void vsfs_destroy_fext_cache(void)
+{
+	kmem_cache_destroy(vsfs_fext_cachep);
+}
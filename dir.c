@@ -22,6 +22,28 @@ static inline int vsfs_match(int len, const unsigned char *name, struct vsfs_dir
 	return !memcmp(name, de->name, len);
 }
 
+/* an inline directory writes its entries straight back to the inode slot */
+static int vsfs_commit_inline_chunk(struct page *page, loff_t pos, unsigned len)
+{
+	struct inode *dir = page->mapping->host;
+	int err;
+
+	err = vsfs_write_inline(dir, (char *)kmap(page) + pos, pos, len);
+	kunmap(page);
+	if (!err && pos + len > dir->i_size) {
+		i_size_write(dir, pos + len);
+		mark_inode_dirty(dir);
+	}
+
+	if (!err && IS_DIRSYNC(dir)) {
+		err = sync_mapping_buffers(dir->i_mapping);
+		if (!err)
+			err = sync_inode_metadata(dir, 1);
+	}
+	unlock_page(page);
+	return err;
+}
+
 static int vsfs_commit_chunk(struct page *page, loff_t pos, unsigned len)
 {
 	struct address_space *mapping = page->mapping;
@@ -29,6 +51,9 @@ static int vsfs_commit_chunk(struct page *page, loff_t pos, unsigned len)
 	int err = 0;
 
 	inode_inc_iversion(dir);
+	if (vsfs_has_inline_data(dir))
+		return vsfs_commit_inline_chunk(page, pos, len);
+
 	block_write_end(NULL, mapping, pos, len, len, page, NULL);
 
 	if (pos + len > dir->i_size) {
@@ -163,12 +188,14 @@ int vsfs_add_link(struct dentry *dentry, struct inode *inode)
 	unsigned short rec_len, name_len;
 	struct page *page = NULL;
 	struct vsfs_dir_entry *de;
-	unsigned long npages = dir_pages(dir);
+	unsigned long npages;
 	unsigned long n;
 	char *kaddr;
 	loff_t pos;
 	int err;
 
+restart:
+	npages = dir_pages(dir);
 	for (n = 0; n <= npages; n++) {
 		char *dir_end;
 
@@ -183,6 +210,8 @@ int vsfs_add_link(struct dentry *dentry, struct inode *inode)
 		kaddr += PAGE_SIZE - reclen;
 		while ((char *)de <= kaddr) {
 			if ((char *)de == dir_end) {
+				if (vsfs_has_inline_data(dir))
+					goto promote;
 				name_len = 0;
 				rec_len = VSFS_BLKSIZE;
 				de->rec_len = cpu_to_le16(VSFS_BLKSIZE);
@@ -242,6 +271,15 @@ out_add_link:
 out_unlock:
 	unlock_page(page);
 	goto out_put;
+
+promote:
+	/* no room left inline, move the entries to a block and look again */
+	unlock_page(page);
+	vsfs_put_page(page);
+	err = vsfs_convert_inline(dir, vsfs_get_block);
+	if (err)
+		return err;
+	goto restart;
 }
 
 static inline unsigned vsfs_validate_entry(char *base, unsigned offset, unsigned mask)
@@ -353,13 +391,17 @@ int vsfs_make_empty(struct inode *inode, struct inode *dir)
 	struct address_space *mapping = inode->i_mapping;
 	struct page *page = grab_cache_page(mapping, 0);
 	struct vsfs_dir_entry *de;
+	unsigned chunk = VSFS_BLKSIZE;
 	void *kaddr;
 	int err;
 
 	if (!page)
 		return -ENOMEM;
 
-	err = vsfs_prepare_chunk(page, 0, VSFS_BLKSIZE);
+	if (vsfs_has_inline_data(inode))
+		chunk = vsfs_inline_size(inode->i_sb);
+
+	err = vsfs_prepare_chunk(page, 0, chunk);
 	if (err) {
 		unlock_page(page);
 		goto fail;
@@ -377,13 +419,15 @@ int vsfs_make_empty(struct inode *inode, struct inode *dir)
 
 	de = (struct vsfs_dir_entry *)(kaddr + VSFS_DIR_REC_LEN(1));
 	de->name_len = 2;
-	de->rec_len = cpu_to_le16(VSFS_BLKSIZE - VSFS_DIR_REC_LEN(2));
+	de->rec_len = cpu_to_le16(chunk - VSFS_DIR_REC_LEN(2));
 	memcpy(de->name, "..\0", 4);
 	de->inode = cpu_to_le32(dir->i_ino);
 	de->file_type = fs_umode_to_ftype(inode->i_mode);
 
 	kunmap_atomic(kaddr);
-	err = vsfs_commit_chunk(page, 0, VSFS_BLKSIZE);
+	if (vsfs_has_inline_data(inode))
+		SetPageUptodate(page);
+	err = vsfs_commit_chunk(page, 0, chunk);
 fail:
 	put_page(page);
 	return err;
@@ -437,7 +481,9 @@ not_empty:
 const struct file_operations vsfs_dir_operations = {
         .llseek         = generic_file_llseek,
         .read           = generic_read_dir,
-	.fsync          = generic_file_fsync,
+	.fsync          = vsfs_fsync,
 	.iterate_shared	= vsfs_readdir,
+	.unlocked_ioctl	= vsfs_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
 };
 
@@ -0,0 +1,736 @@
+/*
+ * extents.c
+ *
+ * 2021 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+
+#include "vsfs_fs.h"
+#include "vsfs.h"
+
+/*
+ * An inode with VSFS_EXTENTS_FL maps its blocks with a B+tree of extents
+ * rooted in i_daddr/i_iaddr.  Every node starts with a vsfs_extent_header;
+ * leaves (depth 0) hold vsfs_extents and index nodes vsfs_extent_idxs,
+ * both sorted by logical block, so a lookup is a binary search per level.
+ * Index entries are keyed by the first block of the node below them.
+ *
+ * Everything here runs under truncate_mutex.
+ */
+
+struct vsfs_ext_path {
+	struct buffer_head *p_bh;		/* NULL for the root in the inode */
+	struct vsfs_extent_header *p_hdr;
+	struct vsfs_extent_idx *p_idx;		/* index nodes: the entry followed */
+	struct vsfs_extent *p_ext;		/* leaf: last extent at or before the block */
+};
+
+#define EXT_FIRST_EXTENT(h)	((struct vsfs_extent *)((h) + 1))
+#define EXT_FIRST_INDEX(h)	((struct vsfs_extent_idx *)((h) + 1))
+#define EXT_LAST_EXTENT(h)	(EXT_FIRST_EXTENT(h) + le16_to_cpu((h)->eh_entries) - 1)
+#define EXT_LAST_INDEX(h)	(EXT_FIRST_INDEX(h) + le16_to_cpu((h)->eh_entries) - 1)
+#define EXT_FULL(h)		((h)->eh_entries == (h)->eh_max)
+
+static inline struct vsfs_extent_header *ext_root(struct inode *inode)
+{
+	return (struct vsfs_extent_header *)VSFS_I(inode)->i_data;
+}
+
+static inline unsigned int ext_len(struct vsfs_extent *ex)
+{
+	return le32_to_cpu(ex->ee_len) & ~VSFS_UNWRITTEN_FLAG;
+}
+
+static inline bool ext_unwritten(struct vsfs_extent *ex)
+{
+	return le32_to_cpu(ex->ee_len) & VSFS_UNWRITTEN_FLAG;
+}
+
+static inline void ext_set(struct vsfs_extent *ex, u32 block, unsigned int len, u32 start,
+		bool unwritten)
+{
+	ex->ee_block = cpu_to_le32(block);
+	ex->ee_len = cpu_to_le32(len | (unwritten ? VSFS_UNWRITTEN_FLAG : 0));
+	ex->ee_start = cpu_to_le32(start);
+}
+
+void vsfs_ext_tree_init(struct inode *inode)
+{
+	struct vsfs_extent_header *eh = ext_root(inode);
+
+	BUILD_BUG_ON(sizeof(struct vsfs_extent) != sizeof(struct vsfs_extent_idx));
+	BUILD_BUG_ON(sizeof(struct vsfs_extent_header) +
+			VSFS_EXT_ROOT_MAX * sizeof(struct vsfs_extent) >
+			sizeof(VSFS_I(inode)->i_data));
+
+	memset(VSFS_I(inode)->i_data, 0, sizeof(VSFS_I(inode)->i_data));
+	eh->eh_magic = cpu_to_le16(VSFS_EXT_MAGIC);
+	eh->eh_max = cpu_to_le16(VSFS_EXT_ROOT_MAX);
+}
+
+static int vsfs_ext_check(struct inode *inode, struct vsfs_extent_header *eh, int depth)
+{
+	if (le16_to_cpu(eh->eh_magic) != VSFS_EXT_MAGIC ||
+			le16_to_cpu(eh->eh_depth) != depth || depth > VSFS_EXT_MAX_DEPTH ||
+			!eh->eh_max || le16_to_cpu(eh->eh_entries) > le16_to_cpu(eh->eh_max) ||
+			(depth && !eh->eh_entries)) {
+		vsfs_msg(KERN_ERR, "vsfs_ext_check", "bad extent node in inode %lu, depth %d",
+				inode->i_ino, depth);
+		return -EIO;
+	}
+	return 0;
+}
+
+static void vsfs_ext_drop_path(struct vsfs_ext_path *path, int depth)
+{
+	int i;
+
+	for (i = 0; i <= depth; i++) {
+		brelse(path[i].p_bh);
+		path[i].p_bh = NULL;
+	}
+}
+
+static void vsfs_ext_dirty(struct inode *inode, struct vsfs_ext_path *p)
+{
+	if (p->p_bh)
+		mark_buffer_dirty_inode(p->p_bh, inode);
+	else
+		mark_inode_dirty(inode);
+}
+
+/* last index starting at or before @lblk, or the first one */
+static struct vsfs_extent_idx *vsfs_ext_search_idx(struct vsfs_extent_header *eh, u32 lblk)
+{
+	struct vsfs_extent_idx *l = EXT_FIRST_INDEX(eh) + 1, *r = EXT_LAST_INDEX(eh), *m;
+
+	while (l <= r) {
+		m = l + (r - l) / 2;
+		if (lblk < le32_to_cpu(m->ei_block))
+			r = m - 1;
+		else
+			l = m + 1;
+	}
+	return l - 1;
+}
+
+/* last extent starting at or before @lblk, NULL if there is none */
+static struct vsfs_extent *vsfs_ext_search_ext(struct vsfs_extent_header *eh, u32 lblk)
+{
+	struct vsfs_extent *l = EXT_FIRST_EXTENT(eh), *r = EXT_LAST_EXTENT(eh), *m;
+
+	if (!eh->eh_entries || lblk < le32_to_cpu(l->ee_block))
+		return NULL;
+
+	l++;
+	while (l <= r) {
+		m = l + (r - l) / 2;
+		if (lblk < le32_to_cpu(m->ee_block))
+			r = m - 1;
+		else
+			l = m + 1;
+	}
+	return l - 1;
+}
+
+/* read the node @ix points to, and the nodes of the next few indexes with it */
+static struct buffer_head *vsfs_ext_read_node(struct super_block *sb,
+		struct vsfs_extent_header *eh, struct vsfs_extent_idx *ix)
+{
+	struct vsfs_extent_idx *last = EXT_LAST_INDEX(eh);
+	struct buffer_head *bh;
+	struct blk_plug plug;
+	int n;
+
+	bh = sb_getblk(sb, le32_to_cpu(ix->ei_leaf));
+	if (!bh || buffer_uptodate(bh))
+		return bh;
+
+	blk_start_plug(&plug);
+	for (n = 0, ix++; ix <= last && n < VSFS_IND_RA_BLOCKS; n++, ix++)
+		sb_breadahead(sb, le32_to_cpu(ix->ei_leaf));
+	blk_finish_plug(&plug);
+
+	ll_rw_block(REQ_OP_READ, 0, 1, &bh);
+	wait_on_buffer(bh);
+	if (!buffer_uptodate(bh)) {
+		brelse(bh);
+		return NULL;
+	}
+	return bh;
+}
+
+/* fill @path down to the leaf that holds or would hold @lblk; returns the depth */
+static int vsfs_ext_find(struct inode *inode, u32 lblk, struct vsfs_ext_path *path)
+{
+	struct vsfs_extent_header *eh = ext_root(inode);
+	struct buffer_head *bh;
+	int depth = le16_to_cpu(eh->eh_depth);
+	int i, err;
+
+	err = vsfs_ext_check(inode, eh, depth);
+	if (err)
+		return err;
+
+	memset(path, 0, sizeof(*path) * (depth + 1));
+	path[0].p_hdr = eh;
+	for (i = 0; i < depth; i++) {
+		path[i].p_idx = vsfs_ext_search_idx(path[i].p_hdr, lblk);
+		bh = vsfs_ext_read_node(inode->i_sb, path[i].p_hdr, path[i].p_idx);
+		if (!bh) {
+			vsfs_msg(KERN_ERR, "vsfs_ext_find", "Read failure, inode=%lu, block=%u",
+					inode->i_ino, le32_to_cpu(path[i].p_idx->ei_leaf));
+			err = -EIO;
+			goto fail;
+		}
+		path[i + 1].p_bh = bh;
+		path[i + 1].p_hdr = (struct vsfs_extent_header *)bh->b_data;
+		err = vsfs_ext_check(inode, path[i + 1].p_hdr, depth - i - 1);
+		if (err)
+			goto fail;
+	}
+	path[depth].p_ext = vsfs_ext_search_ext(path[depth].p_hdr, lblk);
+	return depth;
+
+fail:
+	vsfs_ext_drop_path(path, depth);
+	return err;
+}
+
+/* first block mapped past the hole the leaf of @path has @lblk in */
+static u32 vsfs_ext_next_allocated(struct vsfs_ext_path *path, int depth)
+{
+	struct vsfs_extent_header *eh = path[depth].p_hdr;
+	struct vsfs_extent *ex = path[depth].p_ext;
+	int k;
+
+	ex = ex ? ex + 1 : EXT_FIRST_EXTENT(eh);
+	if (eh->eh_entries && ex <= EXT_LAST_EXTENT(eh))
+		return le32_to_cpu(ex->ee_block);
+
+	for (k = depth - 1; k >= 0; k--)
+		if (path[k].p_idx < EXT_LAST_INDEX(path[k].p_hdr))
+			return le32_to_cpu((path[k].p_idx + 1)->ei_block);
+	return VSFS_EXT_MAX_BLOCKS;
+}
+
+/* right behind the last allocation, else in line with the extent to the left */
+static unsigned int vsfs_ext_goal(struct inode *inode, struct vsfs_ext_path *path, int depth,
+		u32 lblk)
+{
+	struct vsfs_inode_info *vsi = VSFS_I(inode);
+	struct vsfs_sb_info *sbi = VSFS_SB(inode->i_sb);
+	struct vsfs_extent *ex = path[depth].p_ext;
+
+	if (lblk == vsi->i_last_alloc_lblk + 1 && vsi->i_last_alloc_pblk)
+		return vsi->i_last_alloc_pblk + 1;
+	if (ex)
+		return le32_to_cpu(ex->ee_start) + lblk - le32_to_cpu(ex->ee_block);
+	if (path[depth].p_bh)
+		return path[depth].p_bh->b_blocknr;
+	return sbi->data_blkaddr + vsfs_ino_data_group(sbi, inode->i_ino) * VSFS_BITS_PER_BLK;
+}
+
+/* the first key of node @level changed, carry it up while it is a first key */
+static void vsfs_ext_correct_indexes(struct inode *inode, struct vsfs_ext_path *path, int level)
+{
+	struct vsfs_extent_header *eh = path[level].p_hdr;
+	__le32 key;
+	int k;
+
+	if (!eh->eh_entries)
+		return;
+	key = eh->eh_depth ? EXT_FIRST_INDEX(eh)->ei_block : EXT_FIRST_EXTENT(eh)->ee_block;
+
+	for (k = level - 1; k >= 0; k--) {
+		path[k].p_idx->ei_block = key;
+		vsfs_ext_dirty(inode, &path[k]);
+		if (path[k].p_idx != EXT_FIRST_INDEX(path[k].p_hdr))
+			break;
+	}
+}
+
+static struct buffer_head *vsfs_ext_new_node(struct inode *inode, unsigned int goal, int depth,
+		unsigned int *nodes, int *err)
+{
+	struct vsfs_extent_header *eh;
+	struct buffer_head *bh;
+	unsigned long count = 1;
+	unsigned int blk;
+
+	blk = vsfs_new_blocks(inode->i_sb, NULL, goal, &count, err);
+	if (*err)
+		return NULL;
+	inode_add_bytes(inode, VSFS_BLKSIZE);
+
+	bh = sb_getblk(inode->i_sb, blk);
+	if (!bh) {
+		vsfs_free_blocks(inode, blk, 1);
+		*err = -ENOMEM;
+		return NULL;
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, VSFS_BLKSIZE);
+	eh = (struct vsfs_extent_header *)bh->b_data;
+	eh->eh_magic = cpu_to_le16(VSFS_EXT_MAGIC);
+	eh->eh_max = cpu_to_le16(VSFS_EXT_NODE_MAX);
+	eh->eh_depth = cpu_to_le16(depth);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty_inode(bh, inode);
+	(*nodes)++;
+	return bh;
+}
+
+/* push the full root down into a new node, adding a level to the tree */
+static int vsfs_ext_grow(struct inode *inode, unsigned int goal, unsigned int *nodes)
+{
+	struct vsfs_extent_header *root = ext_root(inode), *eh;
+	struct vsfs_extent_idx *ix;
+	struct buffer_head *bh;
+	int depth = le16_to_cpu(root->eh_depth);
+	int err;
+
+	if (depth >= VSFS_EXT_MAX_DEPTH)
+		return -EFBIG;
+
+	bh = vsfs_ext_new_node(inode, goal, depth, nodes, &err);
+	if (!bh)
+		return err;
+	eh = (struct vsfs_extent_header *)bh->b_data;
+	memcpy(eh + 1, root + 1, le16_to_cpu(root->eh_entries) * sizeof(struct vsfs_extent));
+	eh->eh_entries = root->eh_entries;
+	mark_buffer_dirty_inode(bh, inode);
+
+	/* ee_block and ei_block both lead their entry */
+	ix = EXT_FIRST_INDEX(root);
+	ix->ei_block = *(__le32 *)(eh + 1);
+	ix->ei_leaf = cpu_to_le32(bh->b_blocknr);
+	ix->ei_unused = 0;
+	root->eh_entries = cpu_to_le16(1);
+	root->eh_depth = cpu_to_le16(depth + 1);
+	mark_inode_dirty(inode);
+	brelse(bh);
+	return 0;
+}
+
+/* move the upper half of the full node @level into a new node next to it */
+static int vsfs_ext_split(struct inode *inode, struct vsfs_ext_path *path, int level,
+		unsigned int *nodes)
+{
+	struct vsfs_extent_header *eh = path[level].p_hdr, *neh;
+	struct vsfs_ext_path *parent = &path[level - 1];
+	int n = le16_to_cpu(eh->eh_entries), half = n / 2;
+	struct vsfs_extent_idx *ix;
+	struct buffer_head *bh;
+	int err;
+
+	bh = vsfs_ext_new_node(inode, path[level].p_bh->b_blocknr, le16_to_cpu(eh->eh_depth),
+			nodes, &err);
+	if (!bh)
+		return err;
+	neh = (struct vsfs_extent_header *)bh->b_data;
+	memcpy(neh + 1, EXT_FIRST_EXTENT(eh) + half, (n - half) * sizeof(struct vsfs_extent));
+	neh->eh_entries = cpu_to_le16(n - half);
+	eh->eh_entries = cpu_to_le16(half);
+	mark_buffer_dirty_inode(bh, inode);
+	mark_buffer_dirty_inode(path[level].p_bh, inode);
+
+	ix = parent->p_idx + 1;
+	memmove(ix + 1, ix, (char *)(EXT_LAST_INDEX(parent->p_hdr) + 1) - (char *)ix);
+	ix->ei_block = *(__le32 *)(neh + 1);
+	ix->ei_leaf = cpu_to_le32(bh->b_blocknr);
+	ix->ei_unused = 0;
+	le16_add_cpu(&parent->p_hdr->eh_entries, 1);
+	vsfs_ext_dirty(inode, parent);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Look @lblk up until its leaf has @need free slots, splitting the lowest
+ * full node whose parent has room, or growing the tree when every node up
+ * to the root is full.
+ */
+static int vsfs_ext_find_room(struct inode *inode, u32 lblk, struct vsfs_ext_path *path,
+		int need, unsigned int *nodes)
+{
+	struct vsfs_extent_header *eh;
+	int depth, level, err;
+
+	while (1) {
+		depth = vsfs_ext_find(inode, lblk, path);
+		if (depth < 0)
+			return depth;
+		eh = path[depth].p_hdr;
+		if (le16_to_cpu(eh->eh_entries) + need <= le16_to_cpu(eh->eh_max))
+			return depth;
+
+		for (level = depth; level > 0; level--)
+			if (!EXT_FULL(path[level - 1].p_hdr))
+				break;
+		if (level)
+			err = vsfs_ext_split(inode, path, level, nodes);
+		else
+			err = vsfs_ext_grow(inode, vsfs_ext_goal(inode, path, depth, lblk), nodes);
+		vsfs_ext_drop_path(path, depth);
+		if (err)
+			return err;
+	}
+}
+
+static bool vsfs_ext_can_merge(struct vsfs_extent *a, struct vsfs_extent *b)
+{
+	return ext_unwritten(a) == ext_unwritten(b) &&
+		le32_to_cpu(a->ee_block) + ext_len(a) == le32_to_cpu(b->ee_block) &&
+		le32_to_cpu(a->ee_start) + ext_len(a) == le32_to_cpu(b->ee_start) &&
+		ext_len(a) + ext_len(b) <= VSFS_EXT_MAX_LEN;
+}
+
+static void vsfs_ext_remove_slot(struct vsfs_extent_header *eh, struct vsfs_extent *ex)
+{
+	memmove(ex, ex + 1, (char *)(EXT_LAST_EXTENT(eh) + 1) - (char *)(ex + 1));
+	le16_add_cpu(&eh->eh_entries, -1);
+}
+
+/* fold @ex into the extents next to it in its leaf where they run on */
+static void vsfs_ext_merge(struct inode *inode, struct vsfs_ext_path *path, int depth,
+		struct vsfs_extent *ex)
+{
+	struct vsfs_extent_header *eh = path[depth].p_hdr;
+
+	if (ex > EXT_FIRST_EXTENT(eh) && vsfs_ext_can_merge(ex - 1, ex)) {
+		ex--;
+		ext_set(ex, le32_to_cpu(ex->ee_block), ext_len(ex) + ext_len(ex + 1),
+				le32_to_cpu(ex->ee_start), ext_unwritten(ex));
+		vsfs_ext_remove_slot(eh, ex + 1);
+	}
+	if (ex < EXT_LAST_EXTENT(eh) && vsfs_ext_can_merge(ex, ex + 1)) {
+		ext_set(ex, le32_to_cpu(ex->ee_block), ext_len(ex) + ext_len(ex + 1),
+				le32_to_cpu(ex->ee_start), ext_unwritten(ex));
+		vsfs_ext_remove_slot(eh, ex + 1);
+	}
+	vsfs_ext_dirty(inode, &path[depth]);
+}
+
+/* put @newex into the tree, merged with its neighbours where it runs on */
+static int vsfs_ext_insert(struct inode *inode, struct vsfs_extent *newex, unsigned int *nodes)
+{
+	struct vsfs_ext_path path[VSFS_EXT_MAX_DEPTH + 1];
+	u32 lblk = le32_to_cpu(newex->ee_block);
+	struct vsfs_extent_header *eh;
+	struct vsfs_extent *ex;
+	int depth;
+
+	/* the common case: appending to the extent on the left */
+	depth = vsfs_ext_find(inode, lblk, path);
+	if (depth < 0)
+		return depth;
+	ex = path[depth].p_ext;
+	if (ex && vsfs_ext_can_merge(ex, newex)) {
+		ext_set(ex, le32_to_cpu(ex->ee_block), ext_len(ex) + ext_len(newex),
+				le32_to_cpu(ex->ee_start), ext_unwritten(ex));
+		vsfs_ext_merge(inode, path, depth, ex);
+		vsfs_ext_drop_path(path, depth);
+		return 0;
+	}
+	vsfs_ext_drop_path(path, depth);
+
+	depth = vsfs_ext_find_room(inode, lblk, path, 1, nodes);
+	if (depth < 0)
+		return depth;
+	eh = path[depth].p_hdr;
+	ex = path[depth].p_ext ? path[depth].p_ext + 1 : EXT_FIRST_EXTENT(eh);
+	memmove(ex + 1, ex, (char *)(EXT_LAST_EXTENT(eh) + 1) - (char *)ex);
+	*ex = *newex;
+	le16_add_cpu(&eh->eh_entries, 1);
+	vsfs_ext_merge(inode, path, depth, ex);
+	if (ex == EXT_FIRST_EXTENT(eh))
+		vsfs_ext_correct_indexes(inode, path, depth);
+	vsfs_ext_drop_path(path, depth);
+	return 0;
+}
+
+/*
+ * First write to part of an unwritten extent: split the written part off,
+ * which leaves up to three extents.  Returns the number of blocks
+ * converted from @lblk on.
+ */
+static int vsfs_ext_convert(struct inode *inode, u32 lblk, unsigned int count,
+		unsigned int *nodes)
+{
+	struct vsfs_ext_path path[VSFS_EXT_MAX_DEPTH + 1];
+	struct vsfs_extent piece[3], *ex;
+	struct vsfs_extent_header *eh;
+	u32 block, start;
+	unsigned int len;
+	int depth, n = 0;
+
+	depth = vsfs_ext_find_room(inode, lblk, path, 2, nodes);
+	if (depth < 0)
+		return depth;
+	eh = path[depth].p_hdr;
+	ex = path[depth].p_ext;
+	if (!ex || !ext_unwritten(ex) || lblk >= le32_to_cpu(ex->ee_block) + ext_len(ex)) {
+		vsfs_msg(KERN_ERR, "vsfs_ext_convert", "no unwritten extent at %u in inode %lu",
+				lblk, inode->i_ino);
+		vsfs_ext_drop_path(path, depth);
+		return -EIO;
+	}
+
+	block = le32_to_cpu(ex->ee_block);
+	start = le32_to_cpu(ex->ee_start);
+	len = ext_len(ex);
+	count = min(count, block + len - lblk);
+
+	if (lblk > block)
+		ext_set(&piece[n++], block, lblk - block, start, true);
+	ext_set(&piece[n++], lblk, count, start + lblk - block, false);
+	if (lblk + count < block + len)
+		ext_set(&piece[n++], lblk + count, block + len - lblk - count,
+				start + lblk + count - block, true);
+
+	memmove(ex + n, ex + 1, (char *)(EXT_LAST_EXTENT(eh) + 1) - (char *)(ex + 1));
+	memcpy(ex, piece, n * sizeof(struct vsfs_extent));
+	le16_add_cpu(&eh->eh_entries, n - 1);
+	vsfs_ext_merge(inode, path, depth, ex + (lblk > block));
+	vsfs_ext_drop_path(path, depth);
+	return count;
+}
+
+/*
+ * The extent-tree side of vsfs_get_blocks(): map up to @maxblocks blocks
+ * from @iblock, allocating the hole there as one extent when creating.
+ * *@nodes counts the tree blocks allocated on the way.
+ */
+int vsfs_ext_get_blocks(struct inode *inode, sector_t iblock, unsigned long maxblocks,
+		u32 *bno, bool *new, bool *unwritten, int flags, unsigned int *nodes)
+{
+	struct vsfs_inode_info *vsi = VSFS_I(inode);
+	struct super_block *sb = inode->i_sb;
+	struct vsfs_ext_path path[VSFS_EXT_MAX_DEPTH + 1];
+	struct vsfs_reserve_window *rsv = NULL;
+	struct vsfs_extent newex, *ex;
+	unsigned long count, avail;
+	unsigned int goal, pblk;
+	u32 lblk = iblock, block;
+	int depth, err = 0;
+
+	if (iblock >= VSFS_EXT_MAX_BLOCKS)
+		return (flags & VSFS_GET_BLOCKS_CREATE) ? -EFBIG : 0;
+
+	mutex_lock(&vsi->truncate_mutex);
+	depth = vsfs_ext_find(inode, lblk, path);
+	if (depth < 0) {
+		err = depth;
+		goto out;
+	}
+
+	ex = path[depth].p_ext;
+	if (ex && lblk < le32_to_cpu(ex->ee_block) + ext_len(ex)) {
+		block = le32_to_cpu(ex->ee_block);
+		pblk = le32_to_cpu(ex->ee_start) + lblk - block;
+		count = min_t(unsigned long, maxblocks, block + ext_len(ex) - lblk);
+		*unwritten = ext_unwritten(ex);
+		vsfs_ext_drop_path(path, depth);
+
+		if (*unwritten && (flags & VSFS_GET_BLOCKS_CREATE) &&
+				!(flags & VSFS_GET_BLOCKS_UNWRITTEN)) {
+			err = vsfs_ext_convert(inode, lblk, count, nodes);
+			if (err < 0)
+				goto out;
+			count = err;
+			*unwritten = false;
+			*new = true;
+		}
+		goto mapped;
+	}
+
+	if (!(flags & VSFS_GET_BLOCKS_CREATE)) {
+		vsfs_ext_drop_path(path, depth);
+		goto out;
+	}
+
+	count = min_t(unsigned long, maxblocks, vsfs_ext_next_allocated(path, depth) - lblk);
+	count = min_t(unsigned long, count, VSFS_EXT_MAX_LEN);
+	goal = vsfs_ext_goal(inode, path, depth, lblk);
+	vsfs_ext_drop_path(path, depth);
+
+	/* delayed allocations already hold their space, others must not eat it */
+	if (!(flags & VSFS_GET_BLOCKS_DELALLOC)) {
+		avail = vsfs_count_free_blocks(sb);
+		if (avail < depth + 2 && vsfs_flush_discards(sb))
+			avail = vsfs_count_free_blocks(sb);
+		if (avail < depth + 2) {
+			err = -ENOSPC;
+			goto out;
+		}
+		count = min_t(unsigned long, count, avail - depth - 1);
+	}
+
+	if (S_ISREG(inode->i_mode) && test_opt(sb, RESERVATION))
+		rsv = &vsi->i_rsv_window;
+	pblk = vsfs_new_blocks(sb, rsv, goal, &count, &err);
+	if (err)
+		goto out;
+	inode_add_bytes(inode, (loff_t)count << VSFS_BLKSHIFT);
+
+	ext_set(&newex, lblk, count, pblk, flags & VSFS_GET_BLOCKS_UNWRITTEN);
+	err = vsfs_ext_insert(inode, &newex, nodes);
+	if (err) {
+		vsfs_free_blocks(inode, pblk, count);
+		goto out;
+	}
+
+	*unwritten = flags & VSFS_GET_BLOCKS_UNWRITTEN;
+	*new = true;
+	vsi->i_last_alloc_lblk = lblk + count - 1;
+	vsi->i_last_alloc_pblk = pblk + count - 1;
+	inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+
+mapped:
+	*bno = pblk;
+	err = count;
+out:
+	mutex_unlock(&vsi->truncate_mutex);
+	return err;
+}
+
+/* how many blocks from @iblock on, at most @maxblocks, are a hole */
+unsigned long vsfs_ext_hole_len(struct inode *inode, sector_t iblock, unsigned long maxblocks)
+{
+	struct vsfs_inode_info *vsi = VSFS_I(inode);
+	struct vsfs_ext_path path[VSFS_EXT_MAX_DEPTH + 1];
+	struct vsfs_extent *ex;
+	u32 lblk = iblock, next;
+	int depth;
+
+	if (iblock >= VSFS_EXT_MAX_BLOCKS)
+		return maxblocks;
+
+	mutex_lock(&vsi->truncate_mutex);
+	depth = vsfs_ext_find(inode, lblk, path);
+	if (depth < 0) {
+		mutex_unlock(&vsi->truncate_mutex);
+		return 1;
+	}
+	ex = path[depth].p_ext;
+	if (ex && lblk < le32_to_cpu(ex->ee_block) + ext_len(ex))
+		next = lblk + 1;		/* filled in since the lookup */
+	else
+		next = vsfs_ext_next_allocated(path, depth);
+	vsfs_ext_drop_path(path, depth);
+	mutex_unlock(&vsi->truncate_mutex);
+
+	return min_t(unsigned long, maxblocks, next - lblk);
+}
+
+/* drop @ex from its leaf, and every node that empties with it */
+static void vsfs_ext_remove_entry(struct inode *inode, struct vsfs_ext_path *path, int depth,
+		struct vsfs_extent *ex, struct vsfs_free_batch *batch)
+{
+	struct vsfs_extent_header *eh = path[depth].p_hdr;
+	bool first = ex == EXT_FIRST_EXTENT(eh);
+	struct vsfs_extent_idx *ix;
+	int level = depth;
+
+	vsfs_ext_remove_slot(eh, ex);
+	vsfs_ext_dirty(inode, &path[depth]);
+
+	while (level > 0 && !path[level].p_hdr->eh_entries) {
+		vsfs_free_batch_add(batch, path[level].p_bh->b_blocknr, 1);
+		bforget(path[level].p_bh);
+		path[level].p_bh = NULL;
+		level--;
+
+		eh = path[level].p_hdr;
+		ix = path[level].p_idx;
+		first = ix == EXT_FIRST_INDEX(eh);
+		memmove(ix, ix + 1, (char *)(EXT_LAST_INDEX(eh) + 1) - (char *)(ix + 1));
+		le16_add_cpu(&eh->eh_entries, -1);
+		vsfs_ext_dirty(inode, &path[level]);
+	}
+
+	if (!level && !eh->eh_entries) {
+		/* nothing left at all, the root is an empty leaf again */
+		eh->eh_depth = 0;
+		mark_inode_dirty(inode);
+		return;
+	}
+	if (first)
+		vsfs_ext_correct_indexes(inode, path, level);
+}
+
+/*
+ * Free the blocks mapped in [@start, @end), one extent at a time from the
+ * right, so the work follows the number of extents and not the length of
+ * the range.  An extent straddling both ends of a punched hole is split.
+ */
+int vsfs_ext_remove_space(struct inode *inode, u32 start, u32 end, struct vsfs_free_batch *batch)
+{
+	struct vsfs_ext_path path[VSFS_EXT_MAX_DEPTH + 1];
+	struct vsfs_extent_header *eh;
+	struct vsfs_extent *ex;
+	u32 cursor, block, ex_end, a, b, pstart;
+	unsigned int nodes = 0;
+	bool uw;
+	int depth;
+
+	if (start >= end)
+		return 0;
+
+	for (cursor = end - 1; ; cursor = a - 1) {
+		depth = vsfs_ext_find(inode, cursor, path);
+		if (depth < 0)
+			return depth;
+		eh = path[depth].p_hdr;
+		ex = path[depth].p_ext;
+		if (!ex || le32_to_cpu(ex->ee_block) + ext_len(ex) <= start) {
+			vsfs_ext_drop_path(path, depth);
+			return 0;
+		}
+
+		block = le32_to_cpu(ex->ee_block);
+		ex_end = block + ext_len(ex);
+		pstart = le32_to_cpu(ex->ee_start);
+		uw = ext_unwritten(ex);
+		a = max(start, block);
+		b = min(end, ex_end);
+
+		if (a > block && b < ex_end) {
+			/* a hole in the middle: the tail becomes an extent of its own */
+			vsfs_ext_drop_path(path, depth);
+			depth = vsfs_ext_find_room(inode, cursor, path, 1, &nodes);
+			if (depth < 0)
+				return depth;
+			eh = path[depth].p_hdr;
+			ex = path[depth].p_ext;
+			memmove(ex + 2, ex + 1, (char *)(EXT_LAST_EXTENT(eh) + 1) - (char *)(ex + 1));
+			le16_add_cpu(&eh->eh_entries, 1);
+			ext_set(ex + 1, b, ex_end - b, pstart + b - block, uw);
+			ext_set(ex, block, a - block, pstart, uw);
+			vsfs_ext_dirty(inode, &path[depth]);
+		} else if (a > block) {
+			ext_set(ex, block, a - block, pstart, uw);
+			vsfs_ext_dirty(inode, &path[depth]);
+		} else if (b < ex_end) {
+			ext_set(ex, b, ex_end - b, pstart + b - block, uw);
+			vsfs_ext_dirty(inode, &path[depth]);
+			if (ex == EXT_FIRST_EXTENT(eh))
+				vsfs_ext_correct_indexes(inode, path, depth);
+		} else {
+			vsfs_ext_remove_entry(inode, path, depth, ex, batch);
+		}
+
+		vsfs_free_batch_add(batch, pstart + a - block, b - a);
+		vsfs_ext_drop_path(path, depth);
+		if (a <= start)
+			return 0;
+	}
+}
@@ -0,0 +1,417 @@
+/*
+ * ialloc.c
+ *
+ * 2021 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/random.h>
+
+#include "vsfs_fs.h"
+#include "vsfs.h"
+
+/*
+ * Free data blocks in the groups the inodes of inode group @ig put their
+ * data in, see vsfs_ino_data_group().
+ */
+static unsigned long vsfs_span_free_blocks(struct vsfs_sb_info *sbi, unsigned int ig)
+{
+	unsigned int g, first, last;
+	unsigned long free = 0;
+
+	first = vsfs_ino_data_group(sbi, (ino_t)ig * VSFS_BITS_PER_BLK + VSFS_ROOT_INO);
+	last = vsfs_ino_data_group(sbi, (ino_t)(ig + 1) * VSFS_BITS_PER_BLK + VSFS_ROOT_INO);
+	last = clamp(last, first + 1, sbi->group_count);
+
+	for (g = first; g < last; g++)
+		free += READ_ONCE(vsfs_get_group(sbi, g)->free_blocks);
+	return free;
+}
+
+/*
+ * Orlov allocator for directories, after ext2.  Top level directories are
+ * spread over the groups with the fewest directories among those with an
+ * above average share of free inodes and blocks.  Others stay near the
+ * parent unless its group is already crowded with directories or low on
+ * space.
+ */
+static int find_group_orlov(struct super_block *sb, struct inode *parent, unsigned int ngroups)
+{
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+	struct vsfs_group_info *grp;
+	unsigned int parent_group = vsfs_ino_group(parent->i_ino);
+	unsigned int group, best_ndir, max_dirs;
+	unsigned long freei, freeb, avefreei, avefreeb, ndirs;
+	unsigned long min_inodes, min_blocks;
+	int best_group = -1;
+	unsigned int i;
+
+	freei = percpu_counter_read_positive(&sbi->free_inodes_counter);
+	freeb = percpu_counter_read_positive(&sbi->free_blocks_counter);
+	ndirs = percpu_counter_read_positive(&sbi->dirs_counter);
+	avefreei = freei / ngroups;
+	avefreeb = freeb / ngroups;
+
+	if (parent->i_ino == VSFS_ROOT_INO) {
+		best_ndir = VSFS_BITS_PER_BLK;
+		group = prandom_u32() % ngroups;
+		for (i = 0; i < ngroups; i++, group++) {
+			if (group >= ngroups)
+				group = 0;
+			grp = vsfs_get_group(sbi, group);
+			if (READ_ONCE(grp->used_dirs) >= best_ndir)
+				continue;
+			if (READ_ONCE(grp->free_inodes) < avefreei)
+				continue;
+			if (vsfs_span_free_blocks(sbi, group) < avefreeb)
+				continue;
+			best_group = group;
+			best_ndir = READ_ONCE(grp->used_dirs);
+		}
+		if (best_group >= 0)
+			return best_group;
+		goto fallback;
+	}
+
+	max_dirs = ndirs / ngroups + VSFS_BITS_PER_BLK / 16;
+	min_inodes = avefreei > VSFS_BITS_PER_BLK / 4 ? avefreei - VSFS_BITS_PER_BLK / 4 : 1;
+	min_blocks = avefreeb / 4 * 3;
+
+	for (i = 0; i < ngroups; i++) {
+		group = (parent_group + i) % ngroups;
+		grp = vsfs_get_group(sbi, group);
+		if (READ_ONCE(grp->used_dirs) >= max_dirs)
+			continue;
+		if (READ_ONCE(grp->free_inodes) < min_inodes)
+			continue;
+		if (vsfs_span_free_blocks(sbi, group) < min_blocks)
+			continue;
+		return group;
+	}
+
+fallback:
+	for (i = 0; i < ngroups; i++) {
+		group = (parent_group + i) % ngroups;
+		grp = vsfs_get_group(sbi, group);
+		if (READ_ONCE(grp->free_inodes) && READ_ONCE(grp->free_inodes) >= avefreei)
+			return group;
+	}
+
+	if (avefreei) {
+		/* the counters are only approximate, try anything with space */
+		avefreei = 0;
+		goto fallback;
+	}
+
+	return -1;
+}
+
+/*
+ * Everything but directories goes into the parent's group if there is
+ * room for the inode and its data, then into a group picked by quadratic
+ * hashing, and finally anywhere with a free inode.
+ */
+static int find_group_other(struct super_block *sb, struct inode *parent, unsigned int ngroups)
+{
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+	unsigned int parent_group = vsfs_ino_group(parent->i_ino);
+	unsigned int group, i;
+
+	group = parent_group;
+	if (group < ngroups && READ_ONCE(vsfs_get_group(sbi, group)->free_inodes) &&
+			vsfs_span_free_blocks(sbi, group))
+		return group;
+
+	/* spread the files of one directory away from another's */
+	group = (parent_group + parent->i_ino) % ngroups;
+	for (i = 1; i < ngroups; i <<= 1) {
+		group += i;
+		if (group >= ngroups)
+			group -= ngroups;
+		if (READ_ONCE(vsfs_get_group(sbi, group)->free_inodes) &&
+				vsfs_span_free_blocks(sbi, group))
+			return group;
+	}
+
+	group = parent_group;
+	for (i = 0; i < ngroups; i++) {
+		if (++group >= ngroups)
+			group = 0;
+		if (READ_ONCE(vsfs_get_group(sbi, group)->free_inodes))
+			return group;
+	}
+
+	return -1;
+}
+
+/*
+ * Claim up to @want free inode numbers and mark them in the imap, starting
+ * in group @start at the imap cursor and moving on to the following groups
+ * if that one is full.  All numbers come from a single group.  As in the
+ * block allocator, the first pass steps over groups another CPU is
+ * allocating from.  Returns how many were claimed, 0 with *@err set if
+ * none were.
+ */
+static int vsfs_claim_inos(struct inode *dir, unsigned int start, umode_t mode,
+		ino_t *inos, int want, int *err)
+{
+	struct super_block *sb = dir->i_sb;
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+	struct vsfs_group_info *grp;
+	struct buffer_head *bitmap_bh;
+	unsigned int g, n, bits, ngroups, cursor, from, limit, bit;
+	bool wrapped;
+	int pass, got;
+
+	ngroups = min(sbi->group_count, sbi->blkcnt_imap);
+	cursor = READ_ONCE(sbi->imap_start_lookup);
+
+	for (pass = 0; pass < 2; pass++) {
+		for (n = 0; n < ngroups; n++) {
+			g = (start + n) % ngroups;
+			grp = vsfs_get_group(sbi, g);
+			if (!READ_ONCE(grp->free_inodes))
+				continue;
+
+			bits = vsfs_group_inode_bits(sbi, g);
+			bitmap_bh = sb_bread(sb, sbi->imap_blkaddr + g);
+			if (!bitmap_bh) {
+				*err = -EIO;
+				return 0;
+			}
+
+			if (!pass && n) {
+				if (!spin_trylock(&grp->lock)) {
+					brelse(bitmap_bh);
+					continue;
+				}
+			} else {
+				spin_lock(&grp->lock);
+			}
+
+			/* resume where the last claim in this group stopped */
+			from = cursor / VSFS_BITS_PER_BLK == g ? cursor % VSFS_BITS_PER_BLK : 0;
+			if (from >= bits)
+				from = 0;
+			limit = bits;
+			bit = from;
+			wrapped = !from;
+			got = 0;
+			while (got < want) {
+				bit = find_next_zero_bit_le(bitmap_bh->b_data, limit, bit);
+				if (bit >= limit) {
+					if (wrapped)
+						break;
+					wrapped = true;
+					limit = from;
+					bit = 0;
+					continue;
+				}
+				__set_bit_le(bit, bitmap_bh->b_data);
+				inos[got++] = (ino_t)g * VSFS_BITS_PER_BLK + bit + VSFS_ROOT_INO;
+				bit++;
+			}
+			if (!got) {
+				spin_unlock(&grp->lock);
+				brelse(bitmap_bh);
+				continue;
+			}
+			grp->free_inodes -= got;
+			if (S_ISDIR(mode))
+				grp->used_dirs++;
+			spin_unlock(&grp->lock);
+
+			percpu_counter_sub(&sbi->free_inodes_counter, got);
+			if (S_ISDIR(mode))
+				percpu_counter_inc(&sbi->dirs_counter);
+			WRITE_ONCE(sbi->imap_start_lookup, g * VSFS_BITS_PER_BLK + bit);
+
+			mark_buffer_dirty(bitmap_bh);
+			set_bit(VSFS_GRP_IMAP_DIRTY, &grp->state);
+			if ((sb->s_flags & SB_SYNCHRONOUS) || IS_DIRSYNC(dir))
+				sync_dirty_buffer(bitmap_bh);
+			brelse(bitmap_bh);
+
+			*err = 0;
+			return got;
+		}
+	}
+
+	*err = -ENOSPC;
+	return 0;
+}
+
+/* clear a claimed or freed inode number in its group's imap */
+static void vsfs_release_ino(struct super_block *sb, ino_t ino, bool dir)
+{
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+	struct vsfs_group_info *grp;
+	struct buffer_head *bitmap_bh;
+	unsigned int g, bit;
+	int was_set;
+
+	if (ino <= VSFS_ROOT_INO || ino >= VSFS_GET_SB(inodes_count) + VSFS_ROOT_INO) {
+		vsfs_msg(KERN_ERR, "vsfs_free_ino", "reserved or nonexistent inode %lu", ino);
+		return;
+	}
+
+	g = vsfs_ino_group(ino);
+	bit = (ino - VSFS_ROOT_INO) % VSFS_BITS_PER_BLK;
+	bitmap_bh = sb_bread(sb, sbi->imap_blkaddr + g);
+	if (!bitmap_bh) {
+		vsfs_msg(KERN_ERR, "vsfs_free_ino", "Failed to read inode bitmap of group %u", g);
+		return;
+	}
+
+	grp = vsfs_get_group(sbi, g);
+	spin_lock(&grp->lock);
+	was_set = __test_and_clear_bit_le(bit, bitmap_bh->b_data);
+	if (was_set) {
+		grp->free_inodes++;
+		if (dir && grp->used_dirs)
+			grp->used_dirs--;
+	}
+	spin_unlock(&grp->lock);
+
+	if (!was_set) {
+		vsfs_msg(KERN_ERR, "vsfs_free_ino", "bit already cleared for inode %lu", ino);
+		brelse(bitmap_bh);
+		return;
+	}
+
+	percpu_counter_inc(&sbi->free_inodes_counter);
+	if (dir)
+		percpu_counter_dec(&sbi->dirs_counter);
+
+	mark_buffer_dirty(bitmap_bh);
+	set_bit(VSFS_GRP_IMAP_DIRTY, &grp->state);
+	if (sb->s_flags & SB_SYNCHRONOUS)
+		sync_dirty_buffer(bitmap_bh);
+	brelse(bitmap_bh);
+}
+
+/*
+ * Per-CPU inode number pools.
+ *
+ * Creating a file claims a batch of numbers from the chosen group in one
+ * go and parks the rest in the creating CPU's pool, so parallel creates in
+ * one directory hit the imap once per batch instead of once per file.
+ * A pool only serves requests for the group it was filled from, which
+ * keeps the placement policy intact.  Parked numbers are marked in the
+ * imap; vsfs_drain_ino_pools() gives them back at sync and unmount.
+ * Directories are spread out by Orlov and never use the pools.
+ */
+static ino_t vsfs_pool_get(struct vsfs_sb_info *sbi, unsigned int group)
+{
+	struct vsfs_ino_pool *pool = raw_cpu_ptr(sbi->ino_pools);
+	ino_t ino = 0;
+
+	/* numbers parked in pools can make the wanted group look full */
+	spin_lock(&pool->lock);
+	if (pool->nr && (pool->group == group ||
+			!READ_ONCE(vsfs_get_group(sbi, group)->free_inodes)))
+		ino = pool->ino[--pool->nr];
+	spin_unlock(&pool->lock);
+	return ino;
+}
+
+/* park @nr claimed numbers of @group, handing back what was parked before */
+static void vsfs_pool_refill(struct super_block *sb, unsigned int group, ino_t *inos, int nr)
+{
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+	struct vsfs_ino_pool *pool = raw_cpu_ptr(sbi->ino_pools);
+	ino_t spare[VSFS_INO_POOL_SIZE];
+	int i, nr_spare;
+
+	spin_lock(&pool->lock);
+	nr_spare = pool->nr;
+	memcpy(spare, pool->ino, nr_spare * sizeof(ino_t));
+	/* handed out from the end, so store them backwards */
+	for (i = 0; i < nr; i++)
+		pool->ino[i] = inos[nr - 1 - i];
+	pool->nr = nr;
+	pool->group = group;
+	spin_unlock(&pool->lock);
+
+	for (i = 0; i < nr_spare; i++)
+		vsfs_release_ino(sb, spare[i], false);
+}
+
+void vsfs_drain_ino_pools(struct super_block *sb)
+{
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+	struct vsfs_ino_pool *pool;
+	ino_t spare[VSFS_INO_POOL_SIZE];
+	int cpu, i, nr;
+
+	if (!sbi->ino_pools)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(sbi->ino_pools, cpu);
+		spin_lock(&pool->lock);
+		nr = pool->nr;
+		memcpy(spare, pool->ino, nr * sizeof(ino_t));
+		pool->nr = 0;
+		spin_unlock(&pool->lock);
+
+		for (i = 0; i < nr; i++)
+			vsfs_release_ino(sb, spare[i], false);
+	}
+}
+
+/*
+ * Take a free inode number in the group the policy above picks, from this
+ * CPU's pool when it has one for that group.
+ */
+ino_t vsfs_new_ino(struct inode *dir, umode_t mode, int *err)
+{
+	struct super_block *sb = dir->i_sb;
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+	ino_t inos[VSFS_INO_POOL_SIZE + 1];
+	unsigned int ngroups;
+	int start, got;
+	ino_t ino;
+
+	ngroups = min(sbi->group_count, sbi->blkcnt_imap);
+
+	if (S_ISDIR(mode)) {
+		start = find_group_orlov(sb, dir, ngroups);
+		if (start < 0)
+			goto no_space;
+		got = vsfs_claim_inos(dir, start, mode, inos, 1, err);
+		return got ? inos[0] : 0;
+	}
+
+	start = find_group_other(sb, dir, ngroups);
+	if (start < 0)
+		goto no_space;
+
+	ino = vsfs_pool_get(sbi, start);
+	if (ino) {
+		*err = 0;
+		return ino;
+	}
+
+	got = vsfs_claim_inos(dir, start, mode, inos, VSFS_INO_POOL_SIZE + 1, err);
+	if (!got)
+		return 0;
+	if (got > 1)
+		vsfs_pool_refill(sb, vsfs_ino_group(inos[0]), inos + 1, got - 1);
+	return inos[0];
+
+no_space:
+	*err = -ENOSPC;
+	return 0;
+}
+
+/*
+ * Return the inode number of a deleted inode to its group.  Called from
+ * evict once nothing can look the inode up any more.
+ */
+void vsfs_free_ino(struct inode *inode)
+{
+	vsfs_release_ino(inode->i_sb, inode->i_ino, S_ISDIR(inode->i_mode));
+}
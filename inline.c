@@ -0,0 +1,233 @@
+/*
+ * inline.c
+ *
+ * 2021 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/iversion.h>
+
+#include "vsfs_fs.h"
+#include "vsfs.h"
+
+/*
+ * An inline inode keeps its contents in its own slot of the inode table,
+ * from i_daddr to the end of the slot, in place of the block pointers.
+ * The copy on disk is the real one: page 0 is filled from it and every
+ * write goes straight back to it, so the page is never left dirty.
+ * Bytes past i_size in the slot may be stale and are never read.
+ */
+
+/* the inode-table block holding @inode, and where its inline area starts */
+static struct buffer_head *vsfs_inline_bh(struct inode *inode, char **area)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+
+	bh = sb_bread(sb, vsfs_inotoba(inode->i_ino));
+	if (!bh) {
+		vsfs_msg(KERN_ERR, "vsfs_inline_bh", "Failed to read inode %lu", inode->i_ino);
+		return NULL;
+	}
+	*area = bh->b_data + vsfs_inotoff(inode->i_ino) + offsetof(struct vsfs_inode, i_daddr);
+	return bh;
+}
+
+int vsfs_read_inline(struct inode *inode, void *buf, unsigned int pos, unsigned int len)
+{
+	struct buffer_head *bh;
+	char *area;
+
+	if (pos + len > vsfs_inline_size(inode->i_sb))
+		return -EIO;
+
+	bh = vsfs_inline_bh(inode, &area);
+	if (!bh)
+		return -EIO;
+	memcpy(buf, area + pos, len);
+	brelse(bh);
+	return 0;
+}
+
+/* copy @len bytes of @buf, or zeros if it is NULL, to @pos of the inline area */
+int vsfs_write_inline(struct inode *inode, const void *buf, unsigned int pos, unsigned int len)
+{
+	struct buffer_head *bh;
+	char *area;
+
+	if (pos + len > vsfs_inline_size(inode->i_sb))
+		return -ENOSPC;
+
+	bh = vsfs_inline_bh(inode, &area);
+	if (!bh)
+		return -EIO;
+	if (buf)
+		memcpy(area + pos, buf, len);
+	else
+		memset(area + pos, 0, len);
+	mark_buffer_dirty_inode(bh, inode);
+	brelse(bh);
+	return 0;
+}
+
+/* fill the locked @page from the inline area, leaving it locked */
+int vsfs_readpage_inline(struct inode *inode, struct page *page)
+{
+	unsigned int size = 0;
+	void *kaddr;
+	int err = 0;
+
+	if (!page->index)
+		size = i_size_read(inode);
+
+	kaddr = kmap(page);
+	if (size)
+		err = vsfs_read_inline(inode, kaddr, 0, size);
+	memset(kaddr + size, 0, PAGE_SIZE - size);
+	flush_dcache_page(page);
+	kunmap(page);
+
+	if (!err)
+		SetPageUptodate(page);
+	return err;
+}
+
+/* a dirty inline page only comes from mmap, copy it back to the inode */
+int vsfs_writepage_inline(struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	unsigned int size = i_size_read(inode);
+	void *kaddr;
+	int err = 0;
+
+	if (!page->index && size) {
+		kaddr = kmap(page);
+		err = vsfs_write_inline(inode, kaddr, 0, size);
+		kunmap(page);
+	}
+	unlock_page(page);
+	return err;
+}
+
+int vsfs_write_inline_begin(struct address_space *mapping, unsigned int flags,
+		struct page **pagep)
+{
+	struct page *page;
+	int err;
+
+	page = grab_cache_page_write_begin(mapping, 0, flags);
+	if (!page)
+		return -ENOMEM;
+
+	if (!PageUptodate(page)) {
+		err = vsfs_readpage_inline(mapping->host, page);
+		if (err) {
+			unlock_page(page);
+			put_page(page);
+			return err;
+		}
+	}
+
+	*pagep = page;
+	return 0;
+}
+
+int vsfs_write_inline_end(struct inode *inode, loff_t pos, unsigned int copied,
+		struct page *page)
+{
+	loff_t size = i_size_read(inode);
+	loff_t from = min(pos, size);
+	void *kaddr;
+	int err;
+
+	/* the gap between the old size and @pos is zero in the page, not on disk */
+	kaddr = kmap(page);
+	err = vsfs_write_inline(inode, kaddr + from, from, pos + copied - from);
+	kunmap(page);
+
+	if (!err && pos + copied > size) {
+		i_size_write(inode, pos + copied);
+		mark_inode_dirty(inode);
+	}
+
+	unlock_page(page);
+	put_page(page);
+	return err ? err : copied;
+}
+
+/* stretch the last entry of an inline directory over the rest of its new block */
+static void vsfs_expand_inline_dir(struct inode *dir, struct page *page)
+{
+	unsigned int size = i_size_read(dir);
+	struct vsfs_dir_entry *de, *last = NULL;
+	char *kaddr = kmap(page);
+
+	de = (struct vsfs_dir_entry *)kaddr;
+	while ((char *)de < kaddr + size && de->rec_len) {
+		last = de;
+		de = (struct vsfs_dir_entry *)((char *)de + le16_to_cpu(de->rec_len));
+	}
+	if (last)
+		last->rec_len = cpu_to_le16(le16_to_cpu(last->rec_len) + VSFS_BLKSIZE - size);
+	kunmap(page);
+}
+
+/*
+ * Move the contents of an inline inode into a data block through page 0,
+ * which @get_block maps or reserves; writeback puts it on disk.  A
+ * directory grows to a whole block on the way.  Called with the inode
+ * locked.
+ */
+int vsfs_convert_inline(struct inode *inode, get_block_t *get_block)
+{
+	struct vsfs_inode_info *vsi = VSFS_I(inode);
+	struct buffer_head map = { .b_size = VSFS_BLKSIZE };
+	struct page *page;
+	int err = 0;
+
+	page = grab_cache_page(inode->i_mapping, 0);
+	if (!page)
+		return -ENOMEM;
+
+	if (!PageUptodate(page)) {
+		err = vsfs_readpage_inline(inode, page);
+		if (err)
+			goto out;
+	}
+
+	vsi->i_inline &= ~VSFS_INLINE_DATA_FL;
+	memset(vsi->i_data, 0, sizeof(vsi->i_data));
+	if (vsfs_has_extents(inode))
+		vsfs_ext_tree_init(inode);
+	if (i_size_read(inode) && vsfs_use_iomap(inode)) {
+		/* iomap pages carry no buffers, writeback looks the block up */
+		err = get_block(inode, 0, &map, 1);
+		if (err) {
+			vsi->i_inline |= VSFS_INLINE_DATA_FL;
+			goto out;
+		}
+		set_page_dirty(page);
+	} else if (i_size_read(inode)) {
+		err = __block_write_begin(page, 0, VSFS_BLKSIZE, get_block);
+		if (err) {
+			vsi->i_inline |= VSFS_INLINE_DATA_FL;
+			goto out;
+		}
+		if (S_ISDIR(inode->i_mode)) {
+			vsfs_expand_inline_dir(inode, page);
+			i_size_write(inode, VSFS_BLKSIZE);
+			inode_inc_iversion(inode);
+		}
+		block_commit_write(page, 0, VSFS_BLKSIZE);
+	}
+	mark_inode_dirty(inode);
+out:
+	unlock_page(page);
+	put_page(page);
+	return err;
+}
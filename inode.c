@@ -9,11 +9,16 @@
 #include <linux/buffer_head.h>
 #include <linux/writeback.h>
 #include <linux/iversion.h>
+#include <linux/falloc.h>
+#include <linux/blkdev.h>
+#include <linux/iomap.h>
+#include <linux/mpage.h>
+#include <linux/bio.h>
 
 #include "vsfs_fs.h"
 #include "vsfs.h"
 
-static int vsfs_block_to_path(sector_t iblock, unsigned int offsets[4])
+static int vsfs_block_to_path(sector_t iblock, unsigned int offsets[4], int *boundary)
 {
 	int ptrs = VSFS_NODE_PER_BLK;
 	int ptrs_bits = VSFS_NODE_PER_BLK_BIT;
@@ -21,24 +26,32 @@ static int vsfs_block_to_path(sector_t iblock, unsigned int offsets[4])
 		indirect_blocks = ptrs,
 		double_blocks = (1 << (ptrs_bits * 2));
 	int n = 0;
+	int final = 0;
 
 	if (iblock < direct_blocks) {
 		offsets[n++] = iblock;
+		final = direct_blocks;
 	} else if ((iblock -= direct_blocks) < indirect_blocks) {
 		offsets[n++] = VSFS_IND_BLK;
 		offsets[n++] = iblock;
+		final = ptrs;
 	} else if ((iblock -= indirect_blocks) < double_blocks) {
 		offsets[n++] = VSFS_DIND_BLK;
 		offsets[n++] = iblock >> ptrs_bits;
 		offsets[n++] = iblock & (ptrs - 1);
+		final = ptrs;
 	} else if (((iblock -= double_blocks) >> (ptrs_bits * 2)) < ptrs) {
 		offsets[n++] = VSFS_TIND_BLK;
 		offsets[n++] = iblock >> (ptrs_bits * 2);
 		offsets[n++] = (iblock >> ptrs_bits) & (ptrs - 1);
 		offsets[n++] = iblock & (ptrs - 1);
+		final = ptrs;
 	} else {
 		vsfs_msg(KERN_ERR, "vsfs_block_to_path", "block > big");
 	}
+	/* # of blocks left in the direct area or indirect block we ended in */
+	if (boundary)
+		*boundary = final - 1 - (iblock & (ptrs - 1));
 	return n;
 
 }
@@ -62,6 +75,49 @@ static inline int verify_chain(Indirect *from, Indirect *to)
 	return (from > to);
 }
 
+/* start reading the indirect blocks that follow @p in its parent */
+static void vsfs_readahead_branches(struct super_block *sb, __le32 *p, __le32 *end)
+{
+	struct blk_plug plug;
+	int n = 0;
+
+	blk_start_plug(&plug);
+	for (; p < end && n < VSFS_IND_RA_BLOCKS; p++) {
+		if (*p) {
+			sb_breadahead(sb, le32_to_cpu(*p));
+			n++;
+		}
+	}
+	blk_finish_plug(&plug);
+}
+
+/*
+ * Read the indirect block @p points to.  If it has to come from disk, a
+ * reader going through the file is about to want its siblings as well,
+ * and each of them maps another 4MB, so they are read ahead with it.
+ */
+static struct buffer_head *vsfs_read_branch(struct super_block *sb, Indirect *p)
+{
+	struct buffer_head *bh;
+
+	bh = sb_getblk(sb, le32_to_cpu(p->key));
+	if (!bh)
+		return NULL;
+	if (buffer_uptodate(bh))
+		return bh;
+
+	if (p->bh)
+		vsfs_readahead_branches(sb, p->p + 1,
+				(__le32 *)p->bh->b_data + VSFS_NODE_PER_BLK);
+	ll_rw_block(REQ_OP_READ, 0, 1, &bh);
+	wait_on_buffer(bh);
+	if (!buffer_uptodate(bh)) {
+		brelse(bh);
+		return NULL;
+	}
+	return bh;
+}
+
 static Indirect *vsfs_find_branch(struct inode *inode, Indirect *chain, unsigned int *offsets, int depth, int *err)
 {
 	struct super_block *sb = inode->i_sb;
@@ -75,7 +131,7 @@ static Indirect *vsfs_find_branch(struct inode *inode, Indirect *chain, unsigned
 	if (!p->key)
 		goto no_block;
 	while (--depth) {
-		bh = sb_bread(sb, le32_to_cpu(p->key));
+		bh = vsfs_read_branch(sb, p);
 		if (!bh)
 			goto failure;
 		if (!verify_chain(chain, p))
@@ -98,86 +154,191 @@ no_block:
 	return p;
 }
 
-static int vsfs_alloc_blocks(struct inode *inode, unsigned int *new_blocks, int indirect_blks, int blks, int *err)
+/* blocks mapped by one slot @depth levels above the data */
+static inline unsigned int vsfs_slot_shift(int depth)
 {
-	struct super_block *sb = inode->i_sb;
-	struct vsfs_sb_info *sbi = VSFS_SB(sb);
-	struct buffer_head *bitmap_bh = NULL;
-	unsigned i, target;
-	int bno, ret = 0;
+	return VSFS_NODE_PER_BLK_BIT * depth;
+}
 
-	*err = 0;
-	target = blks + indirect_blks;
+/*
+ * How many blocks from @iblock on, at most @maxblocks, are a hole.  A
+ * missing indirect block stands for its whole subtree, and the empty
+ * slots that follow it at the same level are taken in as well.
+ */
+static unsigned long vsfs_hole_len(struct inode *inode, sector_t iblock, unsigned long maxblocks)
+{
+	unsigned int offsets[4];
+	Indirect chain[4], *partial;
+	unsigned long count = 1;
+	unsigned int shift;
+	__le32 *p, *end;
+	int depth, level, i, err;
 
-	for (i = 0; i < VSFS_GET_SB(blkcnt_dmap); i++) {
-		brelse(bitmap_bh);
-		bitmap_bh = sb_bread(sb, VSFS_GET_SB(dmap_blkaddr) + i);
-		if (!bitmap_bh) {
-			*err = -EIO;
-			goto failed_alloc_blocks;
-		}
-find_next:
-		bno = 0;
+	if (vsfs_has_extents(inode))
+		return vsfs_ext_hole_len(inode, iblock, maxblocks);
 
-		bno = find_next_zero_bit_le(bitmap_bh->b_data, VSFS_BLKSIZE, 0);
-		if (bno >= vsfs_max_bit(i + 1))
-			continue;
-		if (!test_and_set_bit_le(bno, bitmap_bh->b_data)) {
-			*new_blocks++ = VSFS_GET_SB(data_blkaddr) + vsfs_max_bit(i) + bno;
-			ret++;
-			goto got_alloc_blocks;
-		}
-	}
-	brelse(bitmap_bh);
-	*err = -ENOSPC;
-	goto failed_alloc_blocks;
+	depth = vsfs_block_to_path(iblock, offsets, NULL);
+	if (depth == 0)
+		return 1;
 
-got_alloc_blocks:
-	mark_buffer_dirty(bitmap_bh);
-//	if (sb->s_flags & SB_SYNCHRONOUS)
-		sync_dirty_buffer(bitmap_bh);
-	if (--target > 0)
-		goto find_next;
-	brelse(bitmap_bh);
+	partial = vsfs_find_branch(inode, chain, offsets, depth, &err);
+	if (!partial) {
+		/* filled in since the lookup */
+		partial = chain + depth - 1;
+		goto out;
+	}
+	if (err)
+		goto out;
+
+	level = partial - chain;
+	shift = vsfs_slot_shift(depth - 1 - level);
+	count = 1UL << shift;
+	for (i = level + 1; i < depth; i++)
+		count -= (unsigned long)offsets[i] << vsfs_slot_shift(depth - 1 - i);
+
+	/* the top slot of an indirect tree has no neighbours of its kind */
+	if (level || depth == 1) {
+		end = level ? (__le32 *)partial->bh->b_data + VSFS_NODE_PER_BLK :
+			VSFS_I(inode)->i_data + VSFS_DIR_BLK_CNT;
+		for (p = partial->p + 1; p < end && !*p && count < maxblocks; p++)
+			count += 1UL << shift;
+	}
 
-	if (*(new_blocks - 1) > VSFS_GET_SB(total_blkcnt)) {
-		brelse(bitmap_bh);
-		*err = -EIO;
-		goto failed_alloc_blocks;
+out:
+	while (partial > chain) {
+		brelse(partial->bh);
+		partial--;
 	}
+	return min(count, maxblocks);
+}
 
-	return ret;
+/*
+ * Find a block to put the new branch near: the closest block mapped before
+ * it in the same direct area or indirect block, then the indirect block
+ * itself, and for an empty file the data group that goes with its inode.
+ */
+static unsigned int vsfs_find_near(struct inode *inode, Indirect *ind)
+{
+	struct vsfs_inode_info *vsi = VSFS_I(inode);
+	struct vsfs_sb_info *sbi = VSFS_SB(inode->i_sb);
+	__le32 *start = ind->bh ? (__le32 *)ind->bh->b_data : vsi->i_data;
+	__le32 *p;
 
-failed_alloc_blocks:
-	return ret;
+	for (p = ind->p - 1; p >= start; p--)
+		if (*p)
+			return le32_to_cpu(*p) & ~VSFS_UNWRITTEN_FLAG;
+
+	if (ind->bh)
+		return ind->bh->b_blocknr;
+
+	return sbi->data_blkaddr + vsfs_ino_data_group(sbi, inode->i_ino) * VSFS_BITS_PER_BLK;
 }
 
-void vsfs_free_blocks(struct inode *inode, unsigned int block, unsigned int count)
+/*
+ * A write that continues the last allocation goes right behind it,
+ * anything else next to its neighbours in the mapping.  Called with
+ * truncate_mutex held.
+ */
+static unsigned int vsfs_find_goal(struct inode *inode, sector_t block, Indirect *partial)
+{
+	struct vsfs_inode_info *vsi = VSFS_I(inode);
+
+	if (block == vsi->i_last_alloc_lblk + 1 && vsi->i_last_alloc_pblk)
+		return vsi->i_last_alloc_pblk + 1;
+
+	return vsfs_find_near(inode, partial);
+}
+
+/*
+ * Work out how many data blocks the request can take in one go: all the
+ * way to the boundary if we are going to hang a new indirect block, or
+ * up to the next already mapped slot otherwise.
+ */
+static int vsfs_blks_to_allocate(Indirect *branch, int k, unsigned long blks, int blocks_to_boundary)
+{
+	unsigned long count = 0;
+
+	if (k > 0) {
+		if (blks < blocks_to_boundary + 1)
+			count += blks;
+		else
+			count += blocks_to_boundary + 1;
+		return count;
+	}
+
+	count++;
+	while (count < blks && count <= blocks_to_boundary &&
+			le32_to_cpu(*(branch[0].p + count)) == 0)
+		count++;
+	return count;
+}
+
+/*
+ * Allocate the indirect blocks plus up to @blks contiguous data blocks.
+ * new_blocks[0..indirect_blks-1] receive the indirect blocks and
+ * new_blocks[indirect_blks] the first data block of the run; the return
+ * value is the length of that run.
+ */
+static int vsfs_alloc_blocks(struct inode *inode, unsigned int goal, unsigned int *new_blocks,
+		int indirect_blks, int blks, int *err)
 {
-#if 0
-	struct buffer_head *bitmap_bh = NULL;
-	struct buffer_head *bh;
-	unsigned int bit, i;
 	struct super_block *sb = inode->i_sb;
-	struct vsfs_sb_info *sbi = VSFS_SB(sb);
-#endif
+	struct vsfs_reserve_window *rsv = NULL;
+	unsigned long count = 0;
+	unsigned int current_block = 0;
+	int target, index = 0;
+	int i, ret = 0;
+
+	target = blks + indirect_blks;
+
+	/* only regular files stream enough data to make a window worth it */
+	if (S_ISREG(inode->i_mode) && test_opt(sb, RESERVATION))
+		rsv = &VSFS_I(inode)->i_rsv_window;
+
+	while (1) {
+		count = target;
+		current_block = vsfs_new_blocks(sb, rsv, goal, &count, err);
+		if (*err)
+			goto failed_alloc_blocks;
+		inode_add_bytes(inode, (loff_t)count << VSFS_BLKSHIFT);
+		goal = current_block + count;
+
+		target -= count;
+		while (index < indirect_blks && count) {
+			new_blocks[index++] = current_block++;
+			count--;
+		}
+		if (count > 0)
+			break;
+	}
+
+	new_blocks[index] = current_block;
+	ret = count;
+	*err = 0;
+	return ret;
 
-//	Not implemented yet.. I'll do it later..
+failed_alloc_blocks:
+	for (i = 0; i < index; i++)
+		vsfs_free_blocks(inode, new_blocks[i], 1);
+	return ret;
 }
 
-static int vsfs_alloc_branch(struct inode *inode, Indirect *branch, int indirect_blks, unsigned int *offsets, int *count)
+static int vsfs_alloc_branch(struct inode *inode, unsigned int goal, Indirect *branch,
+		int indirect_blks, unsigned int *offsets, int *count, u32 dflag)
 {
 	struct super_block *sb = inode->i_sb;
 	struct buffer_head *bh;
 	unsigned int new_blocks[4];
-	unsigned i, n, num;
+	unsigned int current_block;
+	int i, n, num;
 	int err;
 
-	num = vsfs_alloc_blocks(inode, new_blocks, indirect_blks, *count, &err);
+	num = vsfs_alloc_blocks(inode, goal, new_blocks, indirect_blks, *count, &err);
 	if (err)
 		return err;
 
-	branch[0].key = cpu_to_le32(new_blocks[0]);
+	/* @dflag marks the data pointers, the indirect ones never carry it */
+	branch[0].key = cpu_to_le32(new_blocks[0] | (indirect_blks ? 0 : dflag));
 	
 	for (n = 1; n <= indirect_blks; n++) {
 		bh = sb_getblk(sb, new_blocks[n - 1]);
@@ -189,8 +350,14 @@ static int vsfs_alloc_branch(struct inode *inode, Indirect *branch, int indirect
 		lock_buffer(bh);
 		memset(bh->b_data, 0, VSFS_BLKSIZE);
 		branch[n].p = (__le32 *)bh->b_data + offsets[n];
-		branch[n].key = cpu_to_le32(new_blocks[n]);
+		branch[n].key = cpu_to_le32(new_blocks[n] | (n == indirect_blks ? dflag : 0));
 		*branch[n].p = branch[n].key;
+		if (n == indirect_blks) {
+			/* the data run lives in the last indirect block */
+			current_block = new_blocks[n] | dflag;
+			for (i = 1; i < num; i++)
+				*(branch[n].p + i) = cpu_to_le32(++current_block);
+		}
 		set_buffer_uptodate(bh);
 		unlock_buffer(bh);
 		mark_buffer_dirty_inode(bh, inode);
@@ -205,13 +372,14 @@ failed_alloc_branch:
 		bforget(branch[i].bh);
 	for (i = 0; i < indirect_blks; i++)
 		vsfs_free_blocks(inode, new_blocks[i], 1);
-	vsfs_free_blocks(inode, new_blocks[i], 1);
+	vsfs_free_blocks(inode, new_blocks[i], num);
 
 	return err;
 }
 
 static void vsfs_splice_branch(struct inode *inode, long block, Indirect *where, int num, int blks)
 {
+	struct vsfs_inode_info *vsi = VSFS_I(inode);
 	int i;
 	unsigned int current_block;
 
@@ -224,6 +392,10 @@ static void vsfs_splice_branch(struct inode *inode, long block, Indirect *where,
 		}
 	}
 
+	/* remember where the run ended for the next vsfs_find_goal() */
+	vsi->i_last_alloc_lblk = block + blks - 1;
+	vsi->i_last_alloc_pblk = (le32_to_cpu(where[num].key) & ~VSFS_UNWRITTEN_FLAG) + blks - 1;
+
 	if (where->bh)
 		mark_buffer_dirty_inode(where->bh, inode);
 
@@ -231,478 +403,2189 @@ static void vsfs_splice_branch(struct inode *inode, long block, Indirect *where,
 	mark_inode_dirty(inode);
 }
 
-static int vsfs_get_block(struct inode *inode, sector_t iblock,
-		struct buffer_head *bh_result, int create)
+static void vsfs_da_release_space(struct inode *, unsigned int, unsigned int);
+
+/*
+ * First write to preallocated blocks: clear the unwritten flag of up to
+ * @count pointers from @where on, stopping at the first one that is no
+ * longer part of the run.  Called with truncate_mutex held.
+ */
+static int vsfs_convert_unwritten(struct inode *inode, Indirect *where, int count)
 {
-	struct super_block *sb = inode->i_sb;
+	u32 first = le32_to_cpu(where->key);
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (le32_to_cpu(where->p[i]) != first + i)
+			break;
+		where->p[i] = cpu_to_le32((first + i) & ~VSFS_UNWRITTEN_FLAG);
+	}
+	where->key = *where->p;
+
+	if (where->bh)
+		mark_buffer_dirty_inode(where->bh, inode);
+	else
+		mark_inode_dirty(inode);
+	return i;
+}
+
+/*
+ * Map (and with VSFS_GET_BLOCKS_CREATE, allocate) up to @maxblocks blocks
+ * starting at @iblock.  A run never crosses the end of the direct area or
+ * of an indirect block, and is either all written or all unwritten, which
+ * *@unwritten tells.  Creating over unwritten blocks converts them, unless
+ * VSFS_GET_BLOCKS_UNWRITTEN asks for preallocation.  Returns the number
+ * of blocks mapped at *@bno, 0 for a hole when not creating, or a
+ * negative error.
+ */
+static int __vsfs_get_blocks(struct inode *inode, sector_t iblock, unsigned long maxblocks,
+		u32 *bno, bool *new, bool *boundary, bool *unwritten, int flags)
+{
+	struct vsfs_inode_info *vsi = VSFS_I(inode);
 	unsigned int offsets[4];
-	unsigned int bno, indirect_blks;
-	int depth = vsfs_block_to_path(iblock, offsets);
 	Indirect chain[4], *partial;
-	int err, count = 1;
-	
+	int blocks_to_boundary = 0;
+	int depth, indirect_blks;
+	int err, count = 0;
+	u32 first_block = 0;
+	unsigned int goal, nodes = 0;
+
+	if (vsfs_has_extents(inode)) {
+		err = vsfs_ext_get_blocks(inode, iblock, maxblocks, bno, new, unwritten, flags,
+				&nodes);
+		if ((flags & VSFS_GET_BLOCKS_DELALLOC) && nodes)
+			vsfs_da_release_space(inode, 0, nodes);
+		return err;
+	}
+
+	depth = vsfs_block_to_path(iblock, offsets, &blocks_to_boundary);
 	if (depth == 0)
 		return -EIO;
 
 	partial = vsfs_find_branch(inode, chain, offsets, depth, &err);
-	if (!partial)
-		goto done_get_block;
+	if (!partial) {
+		first_block = le32_to_cpu(chain[depth - 1].key);
+		count++;
+		while (count < maxblocks && count <= blocks_to_boundary) {
+			u32 blk;
+
+			if (!verify_chain(chain, chain + depth - 1)) {
+				/* truncated under us, go and read it again */
+				err = -EAGAIN;
+				count = 0;
+				partial = chain + depth - 1;
+				break;
+			}
+			/* the flag is part of the value, so runs do not mix states */
+			blk = le32_to_cpu(*(chain[depth - 1].p + count));
+			if (blk == first_block + count)
+				count++;
+			else
+				break;
+		}
+		if (err != -EAGAIN) {
+			if (!(first_block & VSFS_UNWRITTEN_FLAG) ||
+					!(flags & VSFS_GET_BLOCKS_CREATE) ||
+					(flags & VSFS_GET_BLOCKS_UNWRITTEN))
+				goto got_it;
+			/* written for the first time, convert it below */
+			partial = chain + depth - 1;
+		}
+	}
+
+	if (!(flags & VSFS_GET_BLOCKS_CREATE) || err == -EIO)
+		goto cleanup;
+
+	mutex_lock(&vsi->truncate_mutex);
+	/*
+	 * The chain may have changed while we did not hold truncate_mutex,
+	 * either by truncate or by another get_block filling the same slot.
+	 */
+	if (err == -EAGAIN || !verify_chain(chain, partial)) {
+		while (partial > chain) {
+			brelse(partial->bh);
+			partial--;
+		}
+		partial = vsfs_find_branch(inode, chain, offsets, depth, &err);
+		if (!partial) {
+			count = 1;
+			partial = chain + depth - 1;
+			goto mapped;
+		}
+		if (err) {
+			mutex_unlock(&vsi->truncate_mutex);
+			goto cleanup;
+		}
+	}
 
-	if (!create || err == -EIO)
-		goto done_get_block;
+	if (partial == chain + depth - 1 && partial->key) {
+mapped:
+		if ((le32_to_cpu(partial->key) & VSFS_UNWRITTEN_FLAG) &&
+				!(flags & VSFS_GET_BLOCKS_UNWRITTEN)) {
+			count = vsfs_convert_unwritten(inode, partial, count);
+			*new = true;
+		}
+		mutex_unlock(&vsi->truncate_mutex);
+		goto got_it;
+	}
 
 	indirect_blks = (chain + depth) - partial - 1;
+	count = vsfs_blks_to_allocate(partial, indirect_blks, maxblocks, blocks_to_boundary);
+
+	/* delayed allocations already hold their space, others must not eat it */
+	if (!(flags & VSFS_GET_BLOCKS_DELALLOC)) {
+		unsigned long avail = vsfs_count_free_blocks(inode->i_sb);
+
+		/* blocks waiting for their discard come back once it is done */
+		if (avail < indirect_blks + 1 && vsfs_flush_discards(inode->i_sb))
+			avail = vsfs_count_free_blocks(inode->i_sb);
+		if (avail < indirect_blks + 1) {
+			err = -ENOSPC;
+			mutex_unlock(&vsi->truncate_mutex);
+			goto cleanup;
+		}
+		count = min_t(unsigned long, count, avail - indirect_blks);
+	}
 
-	err = vsfs_alloc_branch(inode, partial, indirect_blks, offsets, &count);
-	if (err)
-		vsfs_msg(KERN_ERR, "vsfs_get_block", "failed to alloc_brach");
-
+	goal = vsfs_find_goal(inode, iblock, partial);
+	err = vsfs_alloc_branch(inode, goal, partial, indirect_blks, offsets + (partial - chain), &count,
+			(flags & VSFS_GET_BLOCKS_UNWRITTEN) ? VSFS_UNWRITTEN_FLAG : 0);
+	if (err) {
+		mutex_unlock(&vsi->truncate_mutex);
+		goto cleanup;
+	}
+	if ((flags & VSFS_GET_BLOCKS_DELALLOC) && indirect_blks)
+		vsfs_da_release_space(inode, 0, indirect_blks);
 
+	*new = true;
 	vsfs_splice_branch(inode, iblock, partial, indirect_blks, count);
-		
+	mutex_unlock(&vsi->truncate_mutex);
+
+got_it:
+	if (count > blocks_to_boundary)
+		*boundary = true;
+	err = count;
 	partial = chain + depth - 1;
 
-done_get_block:
+cleanup:
 	while (partial > chain) {
 		brelse(partial->bh);
 		partial--;
 	}
-	bno = le32_to_cpu(chain[depth - 1].key);
-	if (bno)
-		map_bh(bh_result, sb, bno);
-	else
-		bh_result = NULL;
-
+	if (err > 0) {
+		*bno = le32_to_cpu(chain[depth - 1].key) & ~VSFS_UNWRITTEN_FLAG;
+		*unwritten = le32_to_cpu(chain[depth - 1].key) & VSFS_UNWRITTEN_FLAG;
+	}
 	return err;
 }
 
-static int vsfs_writepage(struct page *page, struct writeback_control *wbc)
+/* __vsfs_get_blocks() behind the per-inode cache of written runs */
+static int vsfs_get_blocks(struct inode *inode, sector_t iblock, unsigned long maxblocks,
+		u32 *bno, bool *new, bool *boundary, bool *unwritten, int flags)
 {
-	return block_write_full_page(page, vsfs_get_block, wbc);
-}
+	unsigned int seq = vsfs_map_cache_seq(inode);
+	int ret;
 
-static int vsfs_readpage(struct file *file, struct page *page)
-{
-	return block_read_full_page(page, vsfs_get_block);
+	ret = vsfs_map_cache_lookup(inode, iblock, maxblocks, bno);
+	if (ret)
+		return ret;
+
+	ret = __vsfs_get_blocks(inode, iblock, maxblocks, bno, new, boundary, unwritten, flags);
+	if (ret > 0 && !*unwritten)
+		vsfs_map_cache_insert(inode, seq, iblock, ret, *bno);
+	return ret;
 }
 
-int vsfs_prepare_chunk(struct page *page, loff_t pos, unsigned len)
+/*
+ * Delayed allocation.
+ *
+ * With -o delalloc, write_begin only reserves space for a hole and leaves
+ * its buffer mapped to VSFS_DELAYED_BLOCK with BH_Delay set.  The real
+ * block is chosen when writeback hands the buffer back to vsfs_get_block(),
+ * at which point every delayed page behind it is allocated as one run.
+ *
+ * Besides the data block, the first block reserved in a new indirect
+ * region also reserves the indirect blocks it may need.  That estimate is
+ * dropped once the inode has no delayed data left.
+ */
+static int vsfs_da_reserve_space(struct inode *inode, sector_t iblock)
 {
-	return __block_write_begin(page, pos, len, vsfs_get_block);
+	struct vsfs_inode_info *vsi = VSFS_I(inode);
+	unsigned int offsets[4];
+	unsigned int meta = 0;
+	long region = -1;
+	int depth, err;
+
+	depth = vsfs_has_extents(inode) ? 1 : vsfs_block_to_path(iblock, offsets, NULL);
+	if (depth == 0)
+		return -EIO;
+
+	spin_lock(&vsi->i_block_reservation_lock);
+	if (vsfs_has_extents(inode)) {
+		/* about one new tree node for every leaf's worth of new blocks */
+		region = (long)(iblock >> VSFS_NODE_PER_BLK_BIT);
+		if (region != vsi->i_da_last_region)
+			meta = 1;
+	} else if (depth > 1) {
+		region = (long)(iblock - VSFS_DIR_BLK_CNT) >> VSFS_NODE_PER_BLK_BIT;
+		if (region != vsi->i_da_last_region)
+			meta = depth - 1;
+	}
+	spin_unlock(&vsi->i_block_reservation_lock);
+
+	err = vsfs_reserve_blocks(inode->i_sb, 1 + meta);
+	if (err)
+		return err;
+
+	spin_lock(&vsi->i_block_reservation_lock);
+	vsi->i_reserved_data_blocks++;
+	vsi->i_reserved_meta_blocks += meta;
+	if (meta)
+		vsi->i_da_last_region = region;
+	spin_unlock(&vsi->i_block_reservation_lock);
+
+	return 0;
 }
 
-static inline void vsfs_free_data(struct inode *inode, __le32 *p, __le32 *q)
+static void vsfs_da_release_space(struct inode *inode, unsigned int data, unsigned int meta)
 {
-	unsigned long block_to_free = 0, count = 0;
-	unsigned long nr;
+	struct vsfs_inode_info *vsi = VSFS_I(inode);
 
-	for (; p < q; p++) {
-		nr = le32_to_cpu(*p);
-		if (nr) {
-			*p = 0;
-			if (count == 0)
-				goto free_this;
-			else if (block_to_free == nr - count)
-				count++;
-			else {
-				vsfs_free_blocks(inode, block_to_free, count);
-				mark_inode_dirty(inode);
-			free_this:
-				block_to_free = nr;
-				count = 1;
-			}
-		}
+	spin_lock(&vsi->i_block_reservation_lock);
+	data = min(data, vsi->i_reserved_data_blocks);
+	meta = min(meta, vsi->i_reserved_meta_blocks);
+	vsi->i_reserved_data_blocks -= data;
+	vsi->i_reserved_meta_blocks -= meta;
+	if (!vsi->i_reserved_data_blocks) {
+		meta += vsi->i_reserved_meta_blocks;
+		vsi->i_reserved_meta_blocks = 0;
+		vsi->i_da_last_region = -1;
 	}
+	spin_unlock(&vsi->i_block_reservation_lock);
 
-	if (count > 0) {
-		vsfs_free_blocks(inode, block_to_free, count);
-		mark_inode_dirty(inode);
-	}
+	vsfs_release_blocks(inode->i_sb, data + meta);
 }
 
-static void vsfs_free_full_branch(struct inode *inode, unsigned long ind_block, int depth)
+static int vsfs_da_get_block_prep(struct inode *inode, sector_t iblock,
+		struct buffer_head *bh_result, int create)
 {
-	return;
-}	
+	bool new = false, boundary = false, unwritten = false;
+	u32 bno;
+	int ret;
 
-static void vsfs_truncate_blocks(struct inode * inode)
-{
-	struct vsfs_inode_info *vsi = VSFS_I(inode);
-	unsigned int offsets[4];
-//	__le32 *i_data = VSFS_I(inode)->i_data;
-	int depth, depth2;
-	unsigned long block;
-	unsigned i;
-	void *p;
-	sector_t last = 0;
-
-	if (inode->i_size) {
-		last = (inode->i_size - 1) >> VSFS_BLKSHIFT;
-		depth = vsfs_block_to_path(last, offsets);
-		if (!depth)
-			return;
-	} else {
-		depth = 1;
+	ret = vsfs_get_blocks(inode, iblock, 1, &bno, &new, &boundary, &unwritten, 0);
+	if (ret < 0)
+		return ret;
+	if (ret > 0 && unwritten) {
+		/* preallocated: nothing to reserve, but writeback will not look again */
+		ret = vsfs_get_blocks(inode, iblock, 1, &bno, &new, &boundary, &unwritten,
+				VSFS_GET_BLOCKS_CREATE);
+		if (ret <= 0)
+			return ret ? ret : -EIO;
+	}
+	if (ret > 0) {
+		map_bh(bh_result, inode->i_sb, bno);
+		if (new)
+			set_buffer_new(bh_result);
+		return 0;
 	}
 
-	for (depth2 = depth - 1; depth2; depth2--)
-		if (offsets[depth2] != VSFS_NODE_PER_BLK - 1)
-			break;
-	
-	if (depth == 1) {
-		//vsfs_trunc_direct(inode);
-		offsets[0] = VSFS_IND_BLK;
-	} else {
-		p = &vsi->i_data[offsets[0]++];
-		for (i = 0; i < depth2; i++) {
-			block = le32_to_cpu(*(__le32 *)p);
-			if (!block)
+	ret = vsfs_da_reserve_space(inode, iblock);
+	if (ret)
+		return ret;
+
+	map_bh(bh_result, inode->i_sb, VSFS_DELAYED_BLOCK);
+	set_buffer_new(bh_result);
+	set_buffer_delay(bh_result);
+	return 0;
+}
+
+/*
+ * Count the delayed blocks of dirty pages starting at @iblock, so
+ * writeback of the first one can allocate blocks for all of them at once.
+ * The run is walked by block, since with pages over 4K one page holds
+ * several buffers and not each of them need be delayed.  The page of
+ * @iblock is locked by our caller; the others are only looked at if
+ * their lock can be had.
+ */
+static unsigned long vsfs_da_dirty_run(struct inode *inode, sector_t iblock, unsigned long max)
+{
+	struct address_space *mapping = inode->i_mapping;
+	const unsigned int bits = PAGE_SHIFT - VSFS_BLKSHIFT;
+	sector_t eof = (i_size_read(inode) + VSFS_BLKSIZE - 1) >> VSFS_BLKSHIFT;
+	pgoff_t index = iblock >> bits;
+	struct buffer_head *bh;
+	struct page *page = NULL;
+	bool locked = false;
+	sector_t blk;
+	unsigned long n;
+	unsigned int i;
+
+	if (iblock + max > eof)
+		max = eof > iblock ? eof - iblock : 1;
+
+	for (n = 1; n < max; n++) {
+		blk = iblock + n;
+		if (!page || blk >> bits != page->index) {
+			if (page) {
+				if (locked)
+					unlock_page(page);
+				put_page(page);
+			}
+			page = find_get_page(mapping, blk >> bits);
+			if (!page)
+				break;
+			locked = page->index != index;
+			if (locked && !trylock_page(page)) {
+				locked = false;
+				break;
+			}
+			/* ours had its dirty bit taken by writeback already */
+			if (page->mapping != mapping || (locked && !PageDirty(page)) ||
+					!page_has_buffers(page))
 				break;
-		
 		}
+
+		bh = page_buffers(page);
+		for (i = blk & ((1U << bits) - 1); i; i--)
+			bh = bh->b_this_page;
+		if (!buffer_delay(bh))
+			break;
 	}
-	for (i = offsets[0]; i <= VSFS_TIND_BLK; i++) {
-		p = &vsi->i_data[i];
-		block = le32_to_cpu(*(__le32 *)p);
-		if (block) {
-			*(__le32 *)p = 0;
-			vsfs_free_full_branch(inode, block, i - VSFS_IND_BLK + 1);
-		}
+	if (page) {
+		if (locked)
+			unlock_page(page);
+		put_page(page);
 	}
-	mark_inode_dirty(inode);
+	return n;
 }
 
-static void vsfs_write_failed(struct address_space *mapping, loff_t to)
+int vsfs_get_block(struct inode *inode, sector_t iblock,
+		struct buffer_head *bh_result, int create)
 {
-	struct inode *inode = mapping->host;
+	unsigned long maxblocks = bh_result->b_size >> inode->i_blkbits;
+	bool new = false, boundary = false, unwritten = false;
+	int flags = create ? VSFS_GET_BLOCKS_CREATE : 0;
+	u32 bno;
+	int ret;
 
-	if (to > inode->i_size) {
-		truncate_pagecache(inode, inode->i_size);
-		vsfs_truncate_blocks(inode);
+	if (create && buffer_delay(bh_result)) {
+		unsigned int reserved = 0;
+
+		/*
+		 * An earlier block of the run may have allocated us already, and
+		 * given our reservation back with its own.
+		 */
+		ret = vsfs_get_blocks(inode, iblock, 1, &bno, &new, &boundary, &unwritten, 0);
+		if (ret > 0 && unwritten) {
+			/* fallocate got here after the write was buffered */
+			ret = vsfs_get_blocks(inode, iblock, 1, &bno, &new, &boundary, &unwritten, flags);
+			reserved = 1;
+		} else if (!ret) {
+			flags |= VSFS_GET_BLOCKS_DELALLOC;
+			ret = vsfs_get_blocks(inode, iblock,
+					vsfs_da_dirty_run(inode, iblock, VSFS_NODE_PER_BLK),
+					&bno, &new, &boundary, &unwritten, flags);
+			reserved = ret;
+		}
+		if (ret <= 0) {
+			vsfs_msg(KERN_ERR, "vsfs_get_block", "delayed block %llu of inode %lu: %d",
+					(unsigned long long)iblock, inode->i_ino, ret);
+			return ret;
+		}
+		/* the run is allocated, so the reservations of all its blocks go */
+		if (reserved)
+			vsfs_da_release_space(inode, reserved, 0);
+		ret = 1;
+	} else {
+		ret = vsfs_get_blocks(inode, iblock, maxblocks, &bno, &new, &boundary, &unwritten, flags);
+		if (ret <= 0)
+			return ret;
+		/* preallocated but never written: read as a hole */
+		if (unwritten)
+			return 0;
 	}
+
+	map_bh(bh_result, inode->i_sb, bno);
+	bh_result->b_size = (ret << inode->i_blkbits);
+	if (new)
+		set_buffer_new(bh_result);
+	if (boundary)
+		set_buffer_boundary(bh_result);
+	return 0;
 }
 
-static int vsfs_write_begin(struct file *file, struct address_space *mapping,
-		loff_t pos, unsigned len, unsigned flags,
-		struct page **pagep, void **fsdata)
+/*
+ * Whether delayed block @iblock still holds its reservation: it does
+ * until a run allocates it, as a hole or as a block fallocate left
+ * unwritten.
+ */
+static bool vsfs_da_reserved(struct inode *inode, sector_t iblock)
 {
+	bool new = false, boundary = false, unwritten = false;
+	u32 bno;
 	int ret;
 
-	ret = block_write_begin(mapping, pos, len, flags, pagep,
-			vsfs_get_block);
-	if (unlikely(ret))
-		vsfs_write_failed(mapping, pos + len);
-
-	return ret;
+	ret = vsfs_get_blocks(inode, iblock, 1, &bno, &new, &boundary, &unwritten, 0);
+	return ret <= 0 || unwritten;
 }
 
-static int vsfs_write_end(struct file *file, struct address_space *mapping,
-		loff_t pos, unsigned len, unsigned copied,
-		struct page *page, void *fsdata)
+/*
+ * Hand back the reservations of delayed buffers that are thrown away
+ * before writeback got to them.  Truncate and hole punching drop the
+ * pages before the blocks, so one a run already allocated still shows.
+ */
+static void vsfs_invalidatepage(struct page *page, unsigned int offset, unsigned int length)
 {
-	int ret;
+	struct inode *inode = page->mapping->host;
+	struct buffer_head *head, *bh;
+	unsigned int curr_off = 0, stop = offset + length;
+	unsigned int delayed = 0;
+	sector_t iblock = (sector_t)page->index << (PAGE_SHIFT - VSFS_BLKSHIFT);
+
+	if (page_has_buffers(page)) {
+		head = bh = page_buffers(page);
+		do {
+			unsigned int next_off = curr_off + bh->b_size;
+
+			if (next_off > stop)
+				break;
+			if (offset <= curr_off && buffer_delay(bh) &&
+					vsfs_da_reserved(inode, iblock))
+				delayed++;
+			curr_off = next_off;
+			bh = bh->b_this_page;
+			iblock++;
+		} while (bh != head);
+	}
 
-	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
-	if (ret < len)
-		vsfs_write_failed(mapping, pos + len);
-	return ret;
+	if (delayed)
+		vsfs_da_release_space(inode, delayed, 0);
+	block_invalidatepage(page, offset, length);
 }
 
-static sector_t vsfs_bmap(struct address_space *mapping, sector_t block)
+static int vsfs_writepage(struct page *page, struct writeback_control *wbc)
 {
-	return generic_block_bmap(mapping, block, vsfs_get_block);
+	if (vsfs_has_inline_data(page->mapping->host))
+		return vsfs_writepage_inline(page);
+	return block_write_full_page(page, vsfs_get_block, wbc);
+}
+
+/*
+ * Batched writeback for the buffer_head path.
+ *
+ * write_cache_pages() walks the dirty pages in the order and range the
+ * wbc asks for.  A page whose blocks are all dirty, mapped or delayed,
+ * gets them allocated here and is added to the bio being built as long
+ * as they run on from the previous page on disk.  The page may hold any
+ * number of blocks, so kernels with 16K or 64K pages batch as well.
+ * Anything else, a page over EOF or one only partly dirty or scattered
+ * on disk, flushes the bio and goes through vsfs_writepage() on its own.
+ */
+struct vsfs_wp_data {
+	struct bio *bio;
+	sector_t last_block;				/* disk block of the last page added */
+};
+
+static void vsfs_end_bio_write(struct bio *bio)
+{
+	struct bio_vec *bvec;
+	struct bvec_iter_all iter_all;
+
+	bio_for_each_segment_all(bvec, bio, iter_all) {
+		struct page *page = bvec->bv_page;
+
+		if (bio->bi_status) {
+			SetPageError(page);
+			mapping_set_error(page->mapping, -EIO);
+		}
+		end_page_writeback(page);
+	}
+	bio_put(bio);
+}
+
+static void vsfs_wp_submit(struct vsfs_wp_data *wpd)
+{
+	if (wpd->bio) {
+		submit_bio(wpd->bio);
+		wpd->bio = NULL;
+	}
+}
+
+static int vsfs_wp_page(struct page *page, struct writeback_control *wbc, void *data)
+{
+	struct vsfs_wp_data *wpd = data;
+	struct inode *inode = page->mapping->host;
+	pgoff_t end_index = i_size_read(inode) >> PAGE_SHIFT;
+	sector_t iblock = (sector_t)page->index << (PAGE_SHIFT - VSFS_BLKSHIFT);
+	struct buffer_head *bh, *head;
+	sector_t first = 0;
+	unsigned int nr = 0;
+	struct bio *bio;
+
+	if (vsfs_has_inline_data(inode) || page->index >= end_index ||
+			!page_has_buffers(page))
+		goto single;
+
+	bh = head = page_buffers(page);
+	do {
+		if (!buffer_dirty(bh) || !buffer_uptodate(bh))
+			goto single;
+		if (!buffer_mapped(bh) || buffer_delay(bh)) {
+			if (vsfs_get_block(inode, iblock, bh, 1))
+				goto single;
+			clear_buffer_delay(bh);
+			if (buffer_new(bh)) {
+				clear_buffer_new(bh);
+				clean_bdev_bh_alias(bh);
+			}
+		}
+		if (bh == head)
+			first = bh->b_blocknr;
+		else if (bh->b_blocknr != first + nr)
+			goto single;
+		nr++;
+		iblock++;
+		bh = bh->b_this_page;
+	} while (bh != head);
+
+	if (wpd->bio && first != wpd->last_block + 1)
+		vsfs_wp_submit(wpd);
+alloc:
+	if (!wpd->bio) {
+		bio = bio_alloc(GFP_NOFS, BIO_MAX_PAGES);
+		bio_set_dev(bio, head->b_bdev);
+		bio->bi_iter.bi_sector = first << (VSFS_BLKSHIFT - 9);
+		bio->bi_opf = REQ_OP_WRITE | wbc_to_write_flags(wbc);
+		bio->bi_end_io = vsfs_end_bio_write;
+		wbc_init_bio(wbc, bio);
+		wpd->bio = bio;
+	}
+	if (bio_add_page(wpd->bio, page, PAGE_SIZE, 0) < PAGE_SIZE) {
+		vsfs_wp_submit(wpd);
+		goto alloc;
+	}
+	wbc_account_cgroup_owner(wbc, page, PAGE_SIZE);
+	wpd->last_block = first + nr - 1;
+
+	do {
+		clear_buffer_dirty(bh);
+		bh = bh->b_this_page;
+	} while (bh != head);
+	set_page_writeback(page);
+	unlock_page(page);
+	return 0;
+
+single:
+	vsfs_wp_submit(wpd);
+	return vsfs_writepage(page, wbc);
+}
+
+static int vsfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	struct vsfs_wp_data wpd = { };
+	struct blk_plug plug;
+	int ret;
+
+	blk_start_plug(&plug);
+	ret = write_cache_pages(mapping, wbc, vsfs_wp_page, &wpd);
+	vsfs_wp_submit(&wpd);
+	blk_finish_plug(&plug);
+	return ret;
+}
+
+static int vsfs_readpage(struct file *file, struct page *page)
+{
+	int err;
+
+	if (vsfs_has_inline_data(page->mapping->host)) {
+		err = vsfs_readpage_inline(page->mapping->host, page);
+		unlock_page(page);
+		return err;
+	}
+	return block_read_full_page(page, vsfs_get_block);
+}
+
+/*
+ * Map whole runs of the window through vsfs_get_block() and read them
+ * with as few bios as the layout allows.  Pages of an inline inode are
+ * left to ->readpage.
+ */
+static void vsfs_readahead(struct readahead_control *rac)
+{
+	if (vsfs_has_inline_data(rac->mapping->host))
+		return;
+	mpage_readahead(rac, vsfs_get_block);
+}
+
+int vsfs_prepare_chunk(struct page *page, loff_t pos, unsigned len)
+{
+	if (vsfs_has_inline_data(page->mapping->host))
+		return 0;
+	return __block_write_begin(page, pos, len, vsfs_get_block);
+}
+
+static inline int all_zeroes(__le32 *p, __le32 *q)
+{
+	while (p < q)
+		if (*p++)
+			return 0;
+	return 1;
+}
+
+/*
+ * Find the part of the path to the first block past the new end that is
+ * still shared with blocks we keep, and detach what is not: *@top gets
+ * the root of the subtree hanging off that point, which the caller frees
+ * whole.  Returns the last Indirect of the kept part, whose bh the caller
+ * releases.  Called with truncate_mutex held.
+ */
+static Indirect *vsfs_find_shared(struct inode *inode, int depth, unsigned int offsets[4],
+		Indirect chain[4], __le32 *top)
+{
+	Indirect *partial, *p;
+	int k, err;
+
+	*top = 0;
+	for (k = depth; k > 1 && !offsets[k - 1]; k--)
+		;
+	partial = vsfs_find_branch(inode, chain, offsets, k, &err);
+	if (!partial)
+		partial = chain + k - 1;
+	if (!partial->key && *partial->p)
+		goto no_top;
+	for (p = partial; p > chain && all_zeroes((__le32 *)p->bh->b_data, p->p); p--)
+		;
+	/*
+	 * The rest of the branch is all ours.  If it does not start right at
+	 * the inode it is simpler to step partial->p back than to detach it.
+	 */
+	if (p == chain + k - 1 && p > chain) {
+		p->p--;
+	} else {
+		*top = *p->p;
+		*p->p = 0;
+	}
+
+	while (partial > p) {
+		brelse(partial->bh);
+		partial--;
+	}
+no_top:
+	return partial;
+}
+
+static inline void vsfs_free_data(struct inode *inode, __le32 *p, __le32 *q,
+		struct vsfs_free_batch *batch)
+{
+	unsigned long block_to_free = 0, count = 0;
+	unsigned long nr;
+
+	for (; p < q; p++) {
+		nr = le32_to_cpu(*p) & ~VSFS_UNWRITTEN_FLAG;
+		if (nr) {
+			*p = 0;
+			if (count == 0)
+				goto free_this;
+			else if (block_to_free == nr - count)
+				count++;
+			else {
+				vsfs_free_batch_add(batch, block_to_free, count);
+				mark_inode_dirty(inode);
+			free_this:
+				block_to_free = nr;
+				count = 1;
+			}
+		}
+	}
+
+	if (count > 0) {
+		vsfs_free_batch_add(batch, block_to_free, count);
+		mark_inode_dirty(inode);
+	}
+}
+
+/* free the slots [@p, @q) and, for @depth > 0, the subtrees below them */
+static void vsfs_free_branches(struct inode *inode, __le32 *p, __le32 *q, int depth,
+		struct vsfs_free_batch *batch)
+{
+	struct buffer_head *bh;
+	unsigned long nr;
+
+	if (!depth--) {
+		vsfs_free_data(inode, p, q, batch);
+		return;
+	}
+
+	for (; p < q; p++) {
+		nr = le32_to_cpu(*p);
+		if (!nr)
+			continue;
+		*p = 0;
+		bh = sb_bread(inode->i_sb, nr);
+		if (!bh) {
+			vsfs_msg(KERN_ERR, "vsfs_free_branches", "Read failure, inode=%lu, block=%lu",
+					inode->i_ino, nr);
+			continue;
+		}
+		vsfs_free_branches(inode, (__le32 *)bh->b_data,
+				(__le32 *)bh->b_data + VSFS_NODE_PER_BLK, depth, batch);
+		bforget(bh);
+		vsfs_free_batch_add(batch, nr, 1);
+		mark_inode_dirty(inode);
+	}
+}
+
+static void vsfs_free_full_branch(struct inode *inode, __le32 *top, int depth,
+		struct vsfs_free_batch *batch)
+{
+	__le32 nr = *top;
+
+	if (!nr)
+		return;
+	*top = 0;
+	mark_inode_dirty(inode);
+	vsfs_free_branches(inode, &nr, &nr + 1, depth, batch);
+}
+
+/* free every block at or past @offset */
+static void __vsfs_truncate_blocks(struct inode *inode, loff_t offset)
+{
+	struct vsfs_inode_info *vsi = VSFS_I(inode);
+	__le32 *i_data = vsi->i_data;
+	struct vsfs_free_batch batch;
+	unsigned int offsets[4];
+	Indirect chain[4], *partial;
+	__le32 nr = 0;
+	sector_t iblock;
+	int n;
+
+	iblock = (offset + VSFS_BLKSIZE - 1) >> VSFS_BLKSHIFT;
+	vsfs_map_cache_remove(inode, iblock, ~(sector_t)0);
+	if (vsfs_has_extents(inode)) {
+		mutex_lock(&vsi->truncate_mutex);
+		vsfs_free_batch_init(&batch, inode->i_sb, inode);
+		if (iblock < VSFS_EXT_MAX_BLOCKS)
+			vsfs_ext_remove_space(inode, iblock, VSFS_EXT_MAX_BLOCKS, &batch);
+		goto done;
+	}
+
+	n = vsfs_block_to_path(iblock, offsets, NULL);
+	if (n == 0)
+		return;
+
+	mutex_lock(&vsi->truncate_mutex);
+	vsfs_free_batch_init(&batch, inode->i_sb, inode);
+
+	if (n == 1) {
+		vsfs_free_data(inode, i_data + offsets[0], i_data + VSFS_DIR_BLK_CNT, &batch);
+		goto do_indirects;
+	}
+
+	partial = vsfs_find_shared(inode, n, offsets, chain, &nr);
+	/* kill the top of the shared branch, already detached */
+	if (nr) {
+		if (partial == chain)
+			mark_inode_dirty(inode);
+		else
+			mark_buffer_dirty_inode(partial->bh, inode);
+		vsfs_free_branches(inode, &nr, &nr + 1, (chain + n - 1) - partial, &batch);
+	}
+	/* clear the ends of the indirect blocks on the shared branch */
+	while (partial > chain) {
+		vsfs_free_branches(inode, partial->p + 1,
+				(__le32 *)partial->bh->b_data + VSFS_NODE_PER_BLK,
+				(chain + n - 1) - partial, &batch);
+		mark_buffer_dirty_inode(partial->bh, inode);
+		brelse(partial->bh);
+		partial--;
+	}
+
+do_indirects:
+	/* kill the remaining whole subtrees */
+	switch (offsets[0]) {
+	default:
+		vsfs_free_full_branch(inode, &i_data[VSFS_IND_BLK], 1, &batch);
+		fallthrough;
+	case VSFS_IND_BLK:
+		vsfs_free_full_branch(inode, &i_data[VSFS_DIND_BLK], 2, &batch);
+		fallthrough;
+	case VSFS_DIND_BLK:
+		vsfs_free_full_branch(inode, &i_data[VSFS_TIND_BLK], 3, &batch);
+		fallthrough;
+	case VSFS_TIND_BLK:
+		;
+	}
+
+done:
+	/* a lockless lookup may have read the old pointers meanwhile */
+	vsfs_map_cache_remove(inode, iblock, ~(sector_t)0);
+	vsfs_free_batch_end(&batch);
+	vsi->i_last_alloc_lblk = 0;
+	vsi->i_last_alloc_pblk = 0;
+	vsfs_discard_reservation(inode);
+	mutex_unlock(&vsi->truncate_mutex);
+}
+
+static void vsfs_truncate_blocks(struct inode *inode)
+{
+	if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode)))
+		return;
+	if (vsfs_has_inline_data(inode))
+		return;
+	__vsfs_truncate_blocks(inode, inode->i_size);
+}
+
+static void vsfs_write_failed(struct address_space *mapping, loff_t to)
+{
+	struct inode *inode = mapping->host;
+
+	if (to > inode->i_size) {
+		truncate_pagecache(inode, inode->i_size);
+		vsfs_truncate_blocks(inode);
+	}
+}
+
+/* how a buffered write maps the blocks it dirties */
+static get_block_t *vsfs_write_get_block(struct inode *inode)
+{
+	if (test_opt(inode->i_sb, DELALLOC) && S_ISREG(inode->i_mode))
+		return vsfs_da_get_block_prep;
+	return vsfs_get_block;
+}
+
+static int vsfs_write_begin(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned flags,
+		struct page **pagep, void **fsdata)
+{
+	struct inode *inode = mapping->host;
+	int ret;
+
+	if (vsfs_has_inline_data(inode)) {
+		if (pos + len <= vsfs_inline_size(inode->i_sb))
+			return vsfs_write_inline_begin(mapping, flags, pagep);
+		ret = vsfs_convert_inline(inode, vsfs_write_get_block(inode));
+		if (ret)
+			return ret;
+	}
+
+	ret = block_write_begin(mapping, pos, len, flags, pagep,
+			vsfs_write_get_block(inode));
+	if (unlikely(ret))
+		vsfs_write_failed(mapping, pos + len);
+
+	return ret;
+}
+
+static int vsfs_write_end(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned copied,
+		struct page *page, void *fsdata)
+{
+	int ret;
+
+	if (vsfs_has_inline_data(mapping->host))
+		return vsfs_write_inline_end(mapping->host, pos, copied, page);
+
+	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+	if (ret < len)
+		vsfs_write_failed(mapping, pos + len);
+	return ret;
+}
+
+static sector_t vsfs_bmap(struct address_space *mapping, sector_t block)
+{
+	if (vsfs_has_inline_data(mapping->host))
+		return 0;
+
+	/* delayed blocks have no address until they are written back */
+	if (test_opt(mapping->host->i_sb, DELALLOC) &&
+			mapping_tagged(mapping, PAGECACHE_TAG_DIRTY))
+		filemap_write_and_wait(mapping);
+
+	return generic_block_bmap(mapping, block, vsfs_get_block);
+}
+
+const struct address_space_operations vsfs_aops = {
+	.readpage	= vsfs_readpage,
+	.readahead	= vsfs_readahead,
+	.writepage	= vsfs_writepage,
+	.writepages	= vsfs_writepages,
+	.write_begin	= vsfs_write_begin,
+	.write_end	= vsfs_write_end,
+	.bmap		= vsfs_bmap,
+	.invalidatepage	= vsfs_invalidatepage,
+	.direct_IO	= noop_direct_IO,
+};
+
+/*
+ * Regular files go through iomap unless -o delalloc is on, which keeps
+ * the buffer_head path above: the delayed state of a block lives in its
+ * buffer_head, and iomap pages have none.
+ */
+static int vsfs_iomap_begin(struct inode *inode, loff_t offset, loff_t length,
+		unsigned int flags, struct iomap *iomap, struct iomap *srcmap)
+{
+	sector_t iblock = offset >> VSFS_BLKSHIFT;
+	loff_t end = round_up(offset + length, VSFS_BLKSIZE);
+	unsigned long maxblocks = min_t(loff_t, (end >> VSFS_BLKSHIFT) - iblock, INT_MAX);
+	bool new = false, boundary = false, unwritten = false;
+	loff_t size = i_size_read(inode);
+	int gb_flags = 0;
+	u32 bno;
+	int ret;
+
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->flags = 0;
+
+	/* only fiemap and seek get here for an inline inode, writers convert it first */
+	if (vsfs_has_inline_data(inode)) {
+		iomap->addr = IOMAP_NULL_ADDR;
+		if (offset < size) {
+			iomap->type = IOMAP_INLINE;
+			iomap->offset = 0;
+			iomap->length = size;
+		} else {
+			iomap->type = IOMAP_HOLE;
+			iomap->offset = offset;
+			iomap->length = length;
+		}
+		return 0;
+	}
+
+	if (flags & IOMAP_WRITE)
+		gb_flags = VSFS_GET_BLOCKS_CREATE;
+	/* direct writes fill unwritten blocks, converted once the data is on disk */
+	if ((flags & IOMAP_WRITE) && (flags & IOMAP_DIRECT))
+		gb_flags |= VSFS_GET_BLOCKS_UNWRITTEN;
+
+	ret = vsfs_get_blocks(inode, iblock, maxblocks, &bno, &new, &boundary, &unwritten,
+			gb_flags);
+	if (ret < 0)
+		return ret;
+
+	iomap->offset = (u64)iblock << VSFS_BLKSHIFT;
+	if (!ret) {
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+		iomap->length = (u64)vsfs_hole_len(inode, iblock, maxblocks) << VSFS_BLKSHIFT;
+	} else {
+		iomap->type = unwritten ? IOMAP_UNWRITTEN : IOMAP_MAPPED;
+		iomap->addr = (u64)bno << VSFS_BLKSHIFT;
+		iomap->length = (u64)ret << VSFS_BLKSHIFT;
+	}
+	if (new)
+		iomap->flags |= IOMAP_F_NEW;
+	return 0;
+}
+
+static int vsfs_iomap_end(struct inode *inode, loff_t offset, loff_t length,
+		ssize_t written, unsigned int flags, struct iomap *iomap)
+{
+	/* a short write leaves no blocks allocated past EOF */
+	if ((iomap->type == IOMAP_MAPPED || iomap->type == IOMAP_UNWRITTEN) &&
+			written < length && (flags & IOMAP_WRITE))
+		vsfs_write_failed(inode->i_mapping, offset + length);
+	return 0;
+}
+
+const struct iomap_ops vsfs_iomap_ops = {
+	.iomap_begin	= vsfs_iomap_begin,
+	.iomap_end	= vsfs_iomap_end,
+};
+
+/*
+ * Blocks behind a dirty page were allocated when it was dirtied, so
+ * writeback looks up as long a run as it can without allocating.  Only
+ * a block that is somehow still a hole or unwritten gets mapped on its
+ * own with allocation.
+ */
+static int vsfs_map_blocks(struct iomap_writepage_ctx *wpc, struct inode *inode,
+		loff_t offset)
+{
+	loff_t end = round_up(i_size_read(inode), VSFS_BLKSIZE);
+	int ret;
+
+	if (offset >= wpc->iomap.offset &&
+			offset < wpc->iomap.offset + wpc->iomap.length)
+		return 0;
+
+	ret = vsfs_iomap_begin(inode, offset, max_t(loff_t, end - offset, VSFS_BLKSIZE), 0,
+			&wpc->iomap, NULL);
+	if (ret || wpc->iomap.type == IOMAP_MAPPED)
+		return ret;
+	return vsfs_iomap_begin(inode, offset, VSFS_BLKSIZE, IOMAP_WRITE, &wpc->iomap, NULL);
+}
+
+static const struct iomap_writeback_ops vsfs_writeback_ops = {
+	.map_blocks	= vsfs_map_blocks,
+};
+
+static int vsfs_iomap_readpage(struct file *file, struct page *page)
+{
+	int err;
+
+	if (vsfs_has_inline_data(page->mapping->host)) {
+		err = vsfs_readpage_inline(page->mapping->host, page);
+		unlock_page(page);
+		return err;
+	}
+	return iomap_readpage(page, &vsfs_iomap_ops);
+}
+
+/* pages of an inline inode are left to ->readpage */
+static void vsfs_iomap_readahead(struct readahead_control *rac)
+{
+	if (vsfs_has_inline_data(rac->mapping->host))
+		return;
+	iomap_readahead(rac, &vsfs_iomap_ops);
+}
+
+static int vsfs_iomap_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct iomap_writepage_ctx wpc = { };
+
+	if (vsfs_has_inline_data(page->mapping->host))
+		return vsfs_writepage_inline(page);
+	return iomap_writepage(page, wbc, &wpc, &vsfs_writeback_ops);
+}
+
+static int vsfs_iomap_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	struct iomap_writepage_ctx wpc = { };
+
+	if (vsfs_has_inline_data(mapping->host))
+		return generic_writepages(mapping, wbc);
+	return iomap_writepages(mapping, wbc, &wpc, &vsfs_writeback_ops);
+}
+
+/* only writes that fit inline data come here, see vsfs_file_write_iter() */
+static int vsfs_iomap_write_begin(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned flags,
+		struct page **pagep, void **fsdata)
+{
+	struct inode *inode = mapping->host;
+
+	if (WARN_ON_ONCE(!vsfs_has_inline_data(inode) ||
+				pos + len > vsfs_inline_size(inode->i_sb)))
+		return -EIO;
+	return vsfs_write_inline_begin(mapping, flags, pagep);
+}
+
+static int vsfs_iomap_write_end(struct file *file, struct address_space *mapping,
+		loff_t pos, unsigned len, unsigned copied,
+		struct page *page, void *fsdata)
+{
+	return vsfs_write_inline_end(mapping->host, pos, copied, page);
+}
+
+static sector_t vsfs_iomap_bmap(struct address_space *mapping, sector_t block)
+{
+	if (vsfs_has_inline_data(mapping->host))
+		return 0;
+	return iomap_bmap(mapping, block, &vsfs_iomap_ops);
+}
+
+const struct address_space_operations vsfs_iomap_aops = {
+	.readpage		= vsfs_iomap_readpage,
+	.readahead		= vsfs_iomap_readahead,
+	.writepage		= vsfs_iomap_writepage,
+	.writepages		= vsfs_iomap_writepages,
+	.write_begin		= vsfs_iomap_write_begin,
+	.write_end		= vsfs_iomap_write_end,
+	.set_page_dirty		= iomap_set_page_dirty,
+	.bmap			= vsfs_iomap_bmap,
+	.releasepage		= iomap_releasepage,
+	.invalidatepage		= iomap_invalidatepage,
+	.migratepage		= iomap_migrate_page,
+	.is_partially_uptodate	= iomap_is_partially_uptodate,
+	.error_remove_page	= generic_error_remove_page,
+	.direct_IO		= noop_direct_IO,
+};
+
+/*
+ * Older kernels stored the seconds in the nanosecond fields and left the
+ * seconds fields as mkfs wrote them; a nanosecond count that large can
+ * only be one of those.
+ */
+static void vsfs_decode_time(struct timespec64 *ts, __le64 sec, __le32 nsec)
+{
+	ts->tv_sec = (s64)le64_to_cpu(sec);
+	ts->tv_nsec = le32_to_cpu(nsec);
+	if (ts->tv_nsec >= NSEC_PER_SEC) {
+		ts->tv_sec = ts->tv_nsec;
+		ts->tv_nsec = 0;
+	}
+}
+
+static void vsfs_encode_times(struct inode *inode, struct vsfs_inode *vsfs_inode)
+{
+	vsfs_inode->i_atime = cpu_to_le64(inode->i_atime.tv_sec);
+	vsfs_inode->i_ctime = cpu_to_le64(inode->i_ctime.tv_sec);
+	vsfs_inode->i_mtime = cpu_to_le64(inode->i_mtime.tv_sec);
+	vsfs_inode->i_atime_nsec = cpu_to_le32(inode->i_atime.tv_nsec);
+	vsfs_inode->i_ctime_nsec = cpu_to_le32(inode->i_ctime.tv_nsec);
+	vsfs_inode->i_mtime_nsec = cpu_to_le32(inode->i_mtime.tv_nsec);
 }
 
-const struct address_space_operations vsfs_aops = {
-	.readpage	= vsfs_readpage,
-	.writepage	= vsfs_writepage,
-	.write_begin	= vsfs_write_begin,
-	.write_end	= vsfs_write_end,
-	.bmap		= vsfs_bmap,
-};
-
 static int vsfs_read_inode(struct inode *inode, struct vsfs_inode *vsfs_inode)
 {       
 	struct vsfs_inode_info *vsi = VSFS_I(inode);
 	
 
-	if (inode->i_nlink == 0)
-		return -ESTALE;
+	if (inode->i_nlink == 0)
+		return -ESTALE;
+
+	inode->i_mode = le16_to_cpu(vsfs_inode->i_mode);
+	i_uid_write(inode, le32_to_cpu(vsfs_inode->i_uid));
+	i_gid_write(inode, le32_to_cpu(vsfs_inode->i_gid));
+	set_nlink(inode, le32_to_cpu(vsfs_inode->i_links));
+	inode->i_size = le64_to_cpu(vsfs_inode->i_size);
+	vsfs_decode_time(&inode->i_atime, vsfs_inode->i_atime, vsfs_inode->i_atime_nsec);
+	vsfs_decode_time(&inode->i_ctime, vsfs_inode->i_ctime, vsfs_inode->i_ctime_nsec);
+	vsfs_decode_time(&inode->i_mtime, vsfs_inode->i_mtime, vsfs_inode->i_mtime_nsec);
+	inode->i_blocks = le64_to_cpu(vsfs_inode->i_blocks);
+
+	vsi->i_inline = vsfs_inode->i_inline;
+	vsi->i_flags = le32_to_cpu(vsfs_inode->i_flags);
+	memcpy(vsi->i_data, vsfs_inode->i_daddr, sizeof(vsi->i_data));
+
+	return 0;
+}
+
+static void vsfs_set_inode_ops(struct inode *inode)
+{
+	if (S_ISREG(inode->i_mode)) {
+		inode->i_op = &vsfs_file_inode_operations;
+		inode->i_fop = &vsfs_file_operations;
+		inode->i_mapping->a_ops = vsfs_use_iomap(inode) ? &vsfs_iomap_aops : &vsfs_aops;
+	} else if (S_ISDIR(inode->i_mode)) {
+		inode->i_op = &vsfs_dir_inode_operations;
+		inode->i_fop = &vsfs_dir_operations;
+		inode->i_mapping->a_ops = &vsfs_aops;
+	} 
+}
+
+struct inode *vsfs_iget(struct super_block *sb, unsigned long ino)
+{
+	struct vsfs_inode *vsfs_inode;
+	struct buffer_head *bh;
+	struct inode *inode;
+	int err = -EIO;
+
+	inode = iget_locked(sb, ino);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+	if (!(inode->i_state & I_NEW))
+		return inode;
+
+	inode->i_sb = sb;
+
+	bh = sb_bread(sb, vsfs_inotoba(ino));
+	if (!bh) {
+		vsfs_msg(KERN_ERR, "vsfs_iget", "Failed to read inode %d\n", ino);
+		goto bad_inode;
+	}
+	vsfs_inode = (struct vsfs_inode *)(bh->b_data + vsfs_inotoff(ino));
+	err = vsfs_read_inode(inode, vsfs_inode);
+	brelse(bh);
+	if (err)
+		goto bad_inode;
+
+	inode_inc_iversion(inode);
+
+	vsfs_set_inode_ops(inode);
+
+	unlock_new_inode(inode);
+
+	return inode;
+
+bad_inode:
+	iget_failed(inode);
+	return ERR_PTR(err);
+}
+
+static void vsfs_fill_inode(struct inode *inode, struct vsfs_inode *vsfs_inode)
+{
+	struct vsfs_inode_info *vsi = VSFS_I(inode);
+
+	vsfs_inode->i_mode = cpu_to_le16(inode->i_mode);
+	vsfs_inode->i_links = cpu_to_le32(inode->i_nlink);
+
+	vsfs_inode->i_uid = cpu_to_le32(i_uid_read(inode));
+	vsfs_inode->i_gid = cpu_to_le32(i_gid_read(inode));
+
+	vsfs_inode->i_size = cpu_to_le64(inode->i_size);
+	vsfs_encode_times(inode, vsfs_inode);
+	vsfs_inode->i_blocks = cpu_to_le64(inode->i_blocks);
+	vsfs_inode->i_flags = cpu_to_le32(vsi->i_flags);
+	vsfs_inode->i_inline = vsi->i_inline;
+
+	/* an inline inode's data sits where the pointers go */
+	if (!(vsi->i_inline & VSFS_INLINE_DATA_FL))
+		memcpy(&vsfs_inode->i_daddr, vsi->i_data, sizeof(vsi->i_data));
+	
+	if (!inode->i_nlink)
+		memset(vsfs_inode, 0, sizeof(struct vsfs_inode));
+}
+
+/*
+ * With lazytime an inode whose only change is its timestamps sits on the
+ * dirty-time list for hours.  The inode-table block is going out anyway,
+ * so take the timestamps of such neighbours along and drop their dirty
+ * state, the way ext4 does.
+ */
+static void vsfs_update_other_inodes_time(struct super_block *sb, unsigned long orig_ino,
+		char *base)
+{
+	unsigned int per_block = 1U << VSFS_SB(sb)->inodes_per_block_bits;
+	unsigned long ino = ((orig_ino - VSFS_ROOT_INO) & ~(unsigned long)(per_block - 1)) +
+			VSFS_ROOT_INO;
+	struct inode *inode;
+	unsigned int i;
+
+	rcu_read_lock();
+	for (i = 0; i < per_block; i++, ino++) {
+		if (ino == orig_ino)
+			continue;
+		inode = find_inode_by_ino_rcu(sb, ino);
+		if (!inode || (inode->i_state & (I_FREEING | I_WILL_FREE | I_NEW | I_DIRTY_INODE)) ||
+				!(inode->i_state & I_DIRTY_TIME))
+			continue;
+
+		spin_lock(&inode->i_lock);
+		if (!(inode->i_state & (I_FREEING | I_WILL_FREE | I_NEW | I_DIRTY_INODE)) &&
+				(inode->i_state & I_DIRTY_TIME)) {
+			inode->i_state &= ~(I_DIRTY_TIME | I_DIRTY_TIME_EXPIRED);
+			vsfs_encode_times(inode, (struct vsfs_inode *)(base + vsfs_inotoff(ino)));
+		}
+		spin_unlock(&inode->i_lock);
+	}
+	rcu_read_unlock();
+}
+
+static int vsfs_update_inode(struct inode *inode, int do_sync) {
+	struct super_block *sb = inode->i_sb;
+	struct vsfs_inode *vsfs_inode;
+	struct buffer_head *bh;
+
+	bh = sb_bread(sb, vsfs_inotoba(inode->i_ino));
+	if (!bh) {
+		vsfs_msg(KERN_ERR, "vsfs_update_inode", "Failed to read inode %lu\n", inode->i_ino);
+		return -1;
+	}
+
+	vsfs_inode = (struct vsfs_inode *)(bh->b_data + vsfs_inotoff(inode->i_ino));
+
+	lock_buffer(bh);
+	vsfs_fill_inode(inode, vsfs_inode);
+	if (sb->s_flags & SB_LAZYTIME)
+		vsfs_update_other_inodes_time(sb, inode->i_ino, bh->b_data);
+	unlock_buffer(bh);
+
+	mark_buffer_dirty(bh);
+	if (do_sync)
+		sync_dirty_buffer(bh);
+	brelse(bh);
+
+	return 0;
+}
+
+int vsfs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+	return vsfs_update_inode(inode, wbc->sync_mode == WB_SYNC_ALL);
+}
+
+void vsfs_evict_inode(struct inode *inode)
+{
+	int want_delete = 0;
+
+
+	if (!inode->i_nlink && !is_bad_inode(inode))
+		want_delete = 1;
+	
+	truncate_inode_pages_final(&inode->i_data);
+	vsfs_discard_reservation(inode);
+	if (want_delete) {
+		inode->i_size = 0;
+		vsfs_truncate_blocks(inode);
+		vsfs_update_inode(inode, inode_needs_sync(inode));
+	}
+
+	vsfs_map_cache_remove(inode, 0, ~(sector_t)0);
+	invalidate_inode_buffers(inode);
+	clear_inode(inode);
 
-	inode->i_mode = le16_to_cpu(vsfs_inode->i_mode);
-	i_uid_write(inode, le32_to_cpu(vsfs_inode->i_uid));
-	i_gid_write(inode, le32_to_cpu(vsfs_inode->i_gid));
-	set_nlink(inode, le16_to_cpu(vsfs_inode->i_links));
-	inode->i_size = le32_to_cpu(vsfs_inode->i_size);
-	inode->i_atime.tv_sec = (signed)le32_to_cpu(vsfs_inode->i_atime);
-	inode->i_ctime.tv_sec = (signed)le32_to_cpu(vsfs_inode->i_ctime);
-	inode->i_mtime.tv_sec = (signed)le32_to_cpu(vsfs_inode->i_mtime);
-	inode->i_atime.tv_nsec = inode->i_mtime.tv_nsec = inode->i_ctime.tv_nsec = 0;
-	inode->i_blocks = le32_to_cpu(vsfs_inode->i_blocks);
+	if (want_delete)
+		vsfs_free_ino(inode);
+}
 
-	memcpy(vsi->i_data, vsfs_inode->i_daddr, sizeof(vsi->i_data));
+struct inode *vsfs_new_inode(struct inode *dir, umode_t mode)
+{
+	struct super_block *sb;
+	struct vsfs_sb_info *sbi;
+	ino_t ino = 0;
+	struct inode *inode;
+	struct vsfs_inode_info *vsi;
+	int err = -ENOSPC;
+
+
+	if (!dir || !dir->i_nlink)
+		return ERR_PTR(-EPERM);
+
+	sb = dir->i_sb;
+	inode = new_inode(sb);
+	if (!inode)
+		return ERR_PTR(-ENOMEM);
+
+	vsi = VSFS_I(inode);
+	sbi = VSFS_SB(sb);
+
+	ino = vsfs_new_ino(dir, mode, &err);
+	if (err)
+		goto failed;
+
+	if (ino < VSFS_ROOT_INO || ino >= VSFS_GET_SB(inodes_count) + VSFS_ROOT_INO) {
+		vsfs_msg(KERN_ERR, "vsfs_new_inode", "rserved inode or inode > inodes count");
+		err = -EIO;
+		goto failed;
+	}
+
+	inode->i_ino = ino;
+	inode_init_owner(inode, dir, mode);
+	inode->i_blocks = 0;
+	inode->i_generation = 0;
+	inode->i_mtime = inode->i_atime = inode->i_ctime = current_time(inode);
+	vsi->i_flags = VSFS_I(dir)->i_flags & ~VSFS_EXTENTS_FL;
+	vsi->i_dir_start_lookup = 0;
+	memset(&vsi->i_data, 0, sizeof(vsi->i_data));
+	vsi->i_inline = 0;
+	if ((S_ISREG(mode) || S_ISDIR(mode)) && test_opt(sb, INLINE_DATA))
+		vsi->i_inline = VSFS_INLINE_DATA_FL;
+	if ((S_ISREG(mode) || S_ISDIR(mode)) && test_opt(sb, EXTENTS)) {
+		vsi->i_flags |= VSFS_EXTENTS_FL;
+		if (!vsfs_has_inline_data(inode))
+			vsfs_ext_tree_init(inode);
+	}
+	if (insert_inode_locked(inode) < 0) {
+		err = -EIO;
+		goto failed;
+	}
+
+	mark_inode_dirty(inode);
+	if (IS_DIRSYNC(inode)) {
+		err = sync_inode_metadata(inode, 1);
+		if (err)
+			goto fail_remove_inode;
+	}
+
+	return inode;
+
+fail_remove_inode:
+	clear_nlink(inode);
+	discard_new_inode(inode);
+	return ERR_PTR(err);
+
+failed:
+	make_bad_inode(inode);
+	iput(inode);
+	return ERR_PTR(err);
+}
+
+static int vsfs_setsize(struct inode *inode, loff_t newsize)
+{
+	int err = 0;
+
+	if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode)))
+		return -EINVAL;
+	if (IS_APPEND(inode) || IS_IMMUTABLE(inode))
+		return -EPERM;
+
+	inode_dio_wait(inode);
+
+	if (vsfs_has_inline_data(inode)) {
+		if (newsize > vsfs_inline_size(inode->i_sb)) {
+			err = vsfs_convert_inline(inode, vsfs_write_get_block(inode));
+			if (err)
+				return err;
+		} else {
+			/* what the slot holds past the old size is stale */
+			if (newsize > inode->i_size) {
+				err = vsfs_write_inline(inode, NULL, inode->i_size,
+						newsize - inode->i_size);
+				if (err)
+					return err;
+			}
+			truncate_setsize(inode, newsize);
+			goto out;
+		}
+	}
+
+	if (!vsfs_use_iomap(inode))
+		err = block_truncate_page(inode->i_mapping, newsize, vsfs_get_block);
+	else if (newsize < inode->i_size)
+		err = iomap_truncate_page(inode, newsize, NULL, &vsfs_iomap_ops);
+	if (err)
+		return err;
 
+	truncate_setsize(inode, newsize);
+	__vsfs_truncate_blocks(inode, newsize);
+
+out:
+	inode->i_mtime = inode->i_ctime = current_time(inode);
+	if (inode_needs_sync(inode)) {
+		sync_mapping_buffers(inode->i_mapping);
+		sync_inode_metadata(inode, 1);
+	} else {
+		mark_inode_dirty(inode);
+	}
 	return 0;
 }
 
-static void vsfs_set_inode_ops(struct inode *inode)
+int vsfs_setattr(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = d_inode(dentry);
+	unsigned int ia_valid = attr->ia_valid;
+	int err;
+
+	err= setattr_prepare(dentry, attr);
+	if (err)
+		return err;
+
+	if (ia_valid & ATTR_SIZE && attr->ia_size != inode->i_size) {
+		err = vsfs_setsize(inode, attr->ia_size);
+		if (err)
+			return err;
+	}
+
+	setattr_copy(inode, attr);
+	mark_inode_dirty(inode);
+	return err;
+}
+
+static int vsfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+		u64 start, u64 len)
+{
+	int ret;
+
+	inode_lock(inode);
+	len = min_t(u64, len, i_size_read(inode));
+	ret = iomap_fiemap(inode, fieinfo, start, len, &vsfs_iomap_ops);
+	inode_unlock(inode);
+	return ret;
+}
+
+const struct inode_operations vsfs_file_inode_operations = {
+		.setattr = vsfs_setattr,
+		.fiemap = vsfs_fiemap,
+};
+
+/*
+ * Allocation only dirties the bitmaps, so push them out ahead of the block
+ * pointers and the inode that depend on them.  Writing the data first
+ * gets delayed blocks allocated before we look.
+ */
+int vsfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct super_block *sb = file->f_mapping->host->i_sb;
+	int ret;
+
+	ret = file_write_and_wait_range(file, start, end);
+	if (ret)
+		return ret;
+	ret = vsfs_sync_bitmaps(sb, 1);
+	if (ret)
+		return ret;
+	return generic_file_fsync(file, start, end, datasync);
+}
+
+/*
+ * Walk the slots [@p, @p + @nr) of the direct area or an indirect block,
+ * the first of which maps file block @base, and either punch [@start,
+ * @end) out of them or flag the data blocks mapped there unwritten.
+ * Subtrees that are holes are skipped and ones entirely inside a punched
+ * range are freed whole, so the work follows what is mapped rather than
+ * the length of the range.  An indirect block left with nothing in it is
+ * freed too.  Called with truncate_mutex held.
+ */
+static void vsfs_walk_range(struct inode *inode, __le32 *p, unsigned int nr, int depth,
+		sector_t base, sector_t start, sector_t end, bool punch,
+		struct vsfs_free_batch *batch)
+{
+	unsigned int shift = vsfs_slot_shift(depth);
+	unsigned int i, first, last;
+	struct buffer_head *bh;
+	sector_t slot;
+	u32 blk;
+
+	first = start > base ? (start - base) >> shift : 0;
+	last = min_t(sector_t, nr, ((end - base - 1) >> shift) + 1);
+
+	if (!depth) {
+		if (punch) {
+			vsfs_free_data(inode, p + first, p + last, batch);
+			return;
+		}
+		for (i = first; i < last; i++)
+			if (p[i])
+				p[i] |= cpu_to_le32(VSFS_UNWRITTEN_FLAG);
+		return;
+	}
+
+	for (i = first; i < last; i++) {
+		blk = le32_to_cpu(p[i]);
+		if (!blk)
+			continue;
+		slot = base + ((sector_t)i << shift);
+		if (punch && slot >= start && slot + ((sector_t)1 << shift) <= end) {
+			vsfs_free_branches(inode, p + i, p + i + 1, depth, batch);
+			continue;
+		}
+
+		bh = sb_bread(inode->i_sb, blk);
+		if (!bh) {
+			vsfs_msg(KERN_ERR, "vsfs_walk_range", "Read failure, inode=%lu, block=%u",
+					inode->i_ino, blk);
+			continue;
+		}
+		vsfs_walk_range(inode, (__le32 *)bh->b_data, VSFS_NODE_PER_BLK, depth - 1,
+				slot, start, end, punch, batch);
+		if (punch && all_zeroes((__le32 *)bh->b_data,
+					(__le32 *)bh->b_data + VSFS_NODE_PER_BLK)) {
+			/* nothing left below it */
+			p[i] = 0;
+			bforget(bh);
+			vsfs_free_batch_add(batch, blk, 1);
+		} else {
+			mark_buffer_dirty_inode(bh, inode);
+			brelse(bh);
+		}
+	}
+}
+
+/*
+ * Punch file blocks [@start, @end), or flag them unwritten, under
+ * truncate_mutex.  An extent cannot be flagged in part without being
+ * split, so an extent tree has the range freed either way and left for
+ * the caller to preallocate again.
+ */
+static void vsfs_map_range(struct inode *inode, sector_t start, sector_t end, bool punch)
 {
-	if (S_ISREG(inode->i_mode)) {
-		inode->i_op = &vsfs_file_inode_operations;
-		inode->i_fop = &vsfs_file_operations;
-		inode->i_mapping->a_ops = &vsfs_aops;
-	} else if (S_ISDIR(inode->i_mode)) {
-		inode->i_op = &vsfs_dir_inode_operations;
-		inode->i_fop = &vsfs_dir_operations;
-		inode->i_mapping->a_ops = &vsfs_aops;
-	} 
+	__le32 *i_data = VSFS_I(inode)->i_data;
+	struct vsfs_free_batch batch;
+	sector_t base = VSFS_DIR_BLK_CNT, span;
+	int depth;
+
+	vsfs_map_cache_remove(inode, start, end);
+	vsfs_free_batch_init(&batch, inode->i_sb, inode);
+	if (vsfs_has_extents(inode)) {
+		end = min_t(sector_t, end, VSFS_EXT_MAX_BLOCKS);
+		if (start < end)
+			vsfs_ext_remove_space(inode, start, end, &batch);
+		goto out;
+	}
+	if (start < VSFS_DIR_BLK_CNT)
+		vsfs_walk_range(inode, i_data, VSFS_DIR_BLK_CNT, 0, 0, start,
+				min_t(sector_t, end, VSFS_DIR_BLK_CNT), punch, &batch);
+	for (depth = 1; depth <= 3; depth++) {
+		span = (sector_t)1 << vsfs_slot_shift(depth);
+		if (end > base && start < base + span)
+			vsfs_walk_range(inode, &i_data[VSFS_IND_BLK + depth - 1], 1, depth,
+					base, start, end, punch, &batch);
+		base += span;
+	}
+out:
+	vsfs_map_cache_remove(inode, start, end);
+	vsfs_free_batch_end(&batch);
+	mark_inode_dirty(inode);
 }
 
-struct inode *vsfs_iget(struct super_block *sb, unsigned long ino)
+/*
+ * Zero @length bytes from @from, all within one block, in the page cache.
+ * Like block_truncate_page() a hole or an unwritten block is left alone,
+ * it reads as zeros already.
+ */
+static int vsfs_zero_partial(struct inode *inode, loff_t from, unsigned int length)
 {
-	struct vsfs_inode *vsfs_inode;
+	struct address_space *mapping = inode->i_mapping;
+	pgoff_t index = from >> PAGE_SHIFT;
+	unsigned int offset = from & (PAGE_SIZE - 1);
+	unsigned int pos = VSFS_BLKSIZE;
 	struct buffer_head *bh;
-	struct inode *inode;
-	int err = -EIO;
-
-	inode = iget_locked(sb, ino);
-	if (!inode)
-		return ERR_PTR(-ENOMEM);
-	if (!(inode->i_state & I_NEW))
-		return inode;
+	struct page *page;
+	sector_t iblock;
+	int err = 0;
+
+	if (from >= i_size_read(inode))
+		return 0;
+	if (vsfs_use_iomap(inode))
+		return iomap_zero_range(inode, from,
+				min_t(loff_t, length, i_size_read(inode) - from),
+				NULL, &vsfs_iomap_ops);
+
+	page = grab_cache_page(mapping, index);
+	if (!page)
+		return -ENOMEM;
+
+	if (!page_has_buffers(page))
+		create_empty_buffers(page, VSFS_BLKSIZE, 0);
+
+	bh = page_buffers(page);
+	iblock = (sector_t)index << (PAGE_SHIFT - VSFS_BLKSHIFT);
+	while (offset >= pos) {
+		bh = bh->b_this_page;
+		iblock++;
+		pos += VSFS_BLKSIZE;
+	}
 
-	inode->i_sb = sb;
+	if (!buffer_mapped(bh)) {
+		err = vsfs_get_block(inode, iblock, bh, 0);
+		if (err || !buffer_mapped(bh))
+			goto unlock;
+	}
 
-	bh = sb_bread(sb, vsfs_inotoba(ino));
-	if (!bh) {
-		vsfs_msg(KERN_ERR, "vsfs_iget", "Failed to read inode %d\n", ino);
-		goto bad_inode;
+	if (PageUptodate(page))
+		set_buffer_uptodate(bh);
+	if (!buffer_uptodate(bh) && !buffer_delay(bh)) {
+		ll_rw_block(REQ_OP_READ, 0, 1, &bh);
+		wait_on_buffer(bh);
+		if (!buffer_uptodate(bh)) {
+			err = -EIO;
+			goto unlock;
+		}
 	}
-	vsfs_inode = (struct vsfs_inode *)bh->b_data;
-	err = vsfs_read_inode(inode, vsfs_inode);
-	brelse(bh);
-	if (err)
-		goto bad_inode;
 
-	inode_inc_iversion(inode);
+	zero_user(page, offset, length);
+	mark_buffer_dirty(bh);
 
-	vsfs_set_inode_ops(inode);
+unlock:
+	unlock_page(page);
+	put_page(page);
+	return err;
+}
 
-	unlock_new_inode(inode);
+/* zero the partial blocks at either end of [@start, @end) */
+static int vsfs_zero_edges(struct inode *inode, loff_t start, loff_t end)
+{
+	loff_t mask = VSFS_BLKSIZE - 1;
+	int err = 0;
 
-	return inode;
+	if ((start >> VSFS_BLKSHIFT) == ((end - 1) >> VSFS_BLKSHIFT)) {
+		if ((start & mask) || (end & mask))
+			err = vsfs_zero_partial(inode, start, end - start);
+		return err;
+	}
 
-bad_inode:
-	iget_failed(inode);
-	return ERR_PTR(err);
+	if (start & mask)
+		err = vsfs_zero_partial(inode, start, VSFS_BLKSIZE - (start & mask));
+	if (!err && (end & mask))
+		err = vsfs_zero_partial(inode, end & ~mask, end & mask);
+	return err;
 }
 
-static void vsfs_fill_inode(struct inode *inode, struct vsfs_inode *vsfs_inode)
+/*
+ * Free the blocks wholly inside [@offset, @offset + @len) and zero the
+ * rest of the range.  Blocks past i_size are left alone.
+ */
+static int vsfs_punch_hole(struct inode *inode, loff_t offset, loff_t len)
 {
 	struct vsfs_inode_info *vsi = VSFS_I(inode);
+	loff_t end = offset + len;
+	sector_t first, last;
+	int err;
 
-	vsfs_inode->i_mode = cpu_to_le16(inode->i_mode);
-	vsfs_inode->i_links = cpu_to_le16(inode->i_nlink);
-
-	vsfs_inode->i_uid = cpu_to_le32(i_uid_read(inode));
-	vsfs_inode->i_gid = cpu_to_le32(i_gid_read(inode));
-
-	vsfs_inode->i_size = cpu_to_le64(inode->i_size);
-	vsfs_inode->i_atime_nsec = cpu_to_le32(inode->i_atime.tv_sec);
-	vsfs_inode->i_ctime_nsec = cpu_to_le32(inode->i_ctime.tv_sec);
-	vsfs_inode->i_mtime_nsec = cpu_to_le32(inode->i_mtime.tv_sec);
-	vsfs_inode->i_blocks = cpu_to_le32(inode->i_blocks);
-	vsfs_inode->i_flags = cpu_to_le32(vsi->i_flags);
-
-	memcpy(&vsfs_inode->i_daddr, vsi->i_data, sizeof(vsi->i_data));
-	
-	if (!inode->i_nlink)
-		memset(vsfs_inode, 0, sizeof(struct vsfs_inode));
-}
+	if (offset >= i_size_read(inode))
+		return 0;
+	end = min_t(loff_t, end, round_up(i_size_read(inode), VSFS_BLKSIZE));
 
-static int vsfs_update_inode(struct inode *inode, int do_sync) {
-	struct super_block *sb = inode->i_sb;
-	struct vsfs_inode *vsfs_inode;
-	struct buffer_head *bh;
+	inode_dio_wait(inode);
+	err = vsfs_zero_edges(inode, offset, end);
+	if (err)
+		return err;
 
-	bh = sb_bread(sb, vsfs_inotoba(inode->i_ino));
-	if (!bh) {
-		vsfs_msg(KERN_ERR, "vsfs_update_inode", "Failed to read inode %lu\n", inode->i_ino);
-		return -1;
+	first = round_up(offset, VSFS_BLKSIZE) >> VSFS_BLKSHIFT;
+	last = end >> VSFS_BLKSHIFT;
+	if (first < last) {
+		truncate_pagecache_range(inode, (loff_t)first << VSFS_BLKSHIFT,
+				((loff_t)last << VSFS_BLKSHIFT) - 1);
+		mutex_lock(&vsi->truncate_mutex);
+		vsfs_map_range(inode, first, last, true);
+		vsi->i_last_alloc_lblk = 0;
+		vsi->i_last_alloc_pblk = 0;
+		vsfs_discard_reservation(inode);
+		mutex_unlock(&vsi->truncate_mutex);
 	}
 
-	vsfs_inode = (struct vsfs_inode *)bh->b_data;
+	inode->i_mtime = inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+	return 0;
+}
 
-	vsfs_fill_inode(inode, vsfs_inode);
+/*
+ * Make [@offset, @offset + @len) read as zeros: the partial blocks at the
+ * ends are zeroed in the page cache and the whole blocks in between get
+ * flagged unwritten, so no data has to be written.  The caller then
+ * preallocates whatever in the range is still a hole.
+ */
+static int vsfs_zero_range(struct inode *inode, loff_t offset, loff_t len)
+{
+	struct vsfs_inode_info *vsi = VSFS_I(inode);
+	loff_t end = offset + len;
+	sector_t first, last;
+	int err;
 
-	mark_buffer_dirty(bh);
-	if (do_sync)
-		sync_dirty_buffer(bh);
-	brelse(bh);
+	inode_dio_wait(inode);
+	err = vsfs_zero_edges(inode, offset, end);
+	if (err)
+		return err;
 
+	first = round_up(offset, VSFS_BLKSIZE) >> VSFS_BLKSHIFT;
+	last = end >> VSFS_BLKSHIFT;
+	if (first < last) {
+		truncate_pagecache_range(inode, (loff_t)first << VSFS_BLKSHIFT,
+				((loff_t)last << VSFS_BLKSHIFT) - 1);
+		mutex_lock(&vsi->truncate_mutex);
+		vsfs_map_range(inode, first, last, false);
+		mutex_unlock(&vsi->truncate_mutex);
+	}
 	return 0;
 }
 
-int vsfs_write_inode(struct inode *inode, struct writeback_control *wbc)
+/* preallocate the holes among file blocks [@iblock, @end) as unwritten */
+static int vsfs_alloc_range(struct inode *inode, sector_t iblock, sector_t end)
 {
-	return vsfs_update_inode(inode, wbc->sync_mode == WB_SYNC_ALL);
+	bool new, boundary, unwritten;
+	u32 bno;
+	int ret;
+
+	while (iblock < end) {
+		new = boundary = unwritten = false;
+		ret = vsfs_get_blocks(inode, iblock, min_t(sector_t, end - iblock, VSFS_NODE_PER_BLK),
+				&bno, &new, &boundary, &unwritten,
+				VSFS_GET_BLOCKS_CREATE | VSFS_GET_BLOCKS_UNWRITTEN);
+		if (ret <= 0)
+			return ret ? ret : -EIO;
+		iblock += ret;
+		if (fatal_signal_pending(current))
+			return -EINTR;
+	}
+	return 0;
 }
 
-void vsfs_evict_inode(struct inode *inode)
+/*
+ * Preallocate blocks without writing them, punch holes and zero ranges.
+ * Preallocated blocks are flagged unwritten in the block map and read
+ * back as zeros until data is written to them.
+ */
+static long vsfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
 {
-	int want_delete = 0;
+	struct inode *inode = file_inode(file);
+	int ret;
 
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+	if (!S_ISREG(inode->i_mode))
+		return -ENODEV;
 
-	if (!inode->i_nlink && !is_bad_inode(inode))
-		want_delete = 1;
-	
-	truncate_inode_pages_final(&inode->i_data);
-	if (want_delete) {
-		inode->i_size = 0;
-		if (inode->i_blocks)
-			vsfs_truncate_blocks(inode);
-		vsfs_update_inode(inode, inode_needs_sync(inode));
+	inode_lock(inode);
+	ret = -EPERM;
+	if (IS_APPEND(inode) || IS_IMMUTABLE(inode))
+		goto out;
+
+	if (vsfs_has_inline_data(inode)) {
+		ret = vsfs_convert_inline(inode, vsfs_write_get_block(inode));
+		if (ret)
+			goto out;
 	}
 
-	invalidate_inode_buffers(inode);
-	clear_inode(inode);
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		ret = vsfs_punch_hole(inode, offset, len);
+		goto out;
+	}
+
+	ret = inode_newsize_ok(inode, offset + len);
+	if (ret)
+		goto out;
 
+	if (mode & FALLOC_FL_ZERO_RANGE) {
+		ret = vsfs_zero_range(inode, offset, len);
+		if (ret)
+			goto out;
+	}
+
+	ret = vsfs_alloc_range(inode, offset >> VSFS_BLKSHIFT,
+			(offset + len + VSFS_BLKSIZE - 1) >> VSFS_BLKSHIFT);
+	if (ret)
+		goto out;
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + len > i_size_read(inode))
+		i_size_write(inode, offset + len);
+	inode->i_ctime = current_time(inode);
+	if (mode & FALLOC_FL_ZERO_RANGE)
+		inode->i_mtime = inode->i_ctime;
+	mark_inode_dirty(inode);
+out:
+	inode_unlock(inode);
+	return ret;
 }
 
-struct inode *vsfs_new_inode(struct inode *dir, umode_t mode)
+/* a writer closing the file gives its reservation window back */
+static int vsfs_release_file(struct inode *inode, struct file *filp)
 {
-	struct super_block *sb;
-	struct vsfs_sb_info *sbi;
-	struct buffer_head *bitmap_bh = NULL;
-	struct buffer_head *bh;
-	unsigned i;
-	ino_t ino = 0;
-	struct inode *inode;
-	struct vsfs_inode_info *vsi;
-	struct vsfs_inode *vsfs_inode;
-	struct timespec64 ts;
-	int err = -ENOSPC;
-
+	if (filp->f_mode & FMODE_WRITE) {
+		mutex_lock(&VSFS_I(inode)->truncate_mutex);
+		vsfs_discard_reservation(inode);
+		mutex_unlock(&VSFS_I(inode)->truncate_mutex);
+	}
+	return 0;
+}
 
-	if (!dir || !dir->i_nlink)
-		return ERR_PTR(-EPERM);
+/*
+ * A write that still fits an inline inode goes through ->write_begin
+ * and ->write_end, anything else converts it and goes through iomap.
+ */
+static ssize_t vsfs_buffered_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	ssize_t ret;
+
+	if (!vsfs_use_iomap(inode))
+		return generic_file_write_iter(iocb, from);
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out_unlock;
+	ret = file_remove_privs(file);
+	if (ret)
+		goto out_unlock;
+	ret = file_update_time(file);
+	if (ret)
+		goto out_unlock;
+
+	if (vsfs_has_inline_data(inode)) {
+		if (iocb->ki_pos + iov_iter_count(from) <= vsfs_inline_size(inode->i_sb)) {
+			current->backing_dev_info = inode_to_bdi(inode);
+			ret = generic_perform_write(file, from, iocb->ki_pos);
+			current->backing_dev_info = NULL;
+			goto done;
+		}
+		ret = vsfs_convert_inline(inode, vsfs_get_block);
+		if (ret)
+			goto out_unlock;
+	}
+	ret = iomap_file_buffered_write(iocb, from, &vsfs_iomap_ops);
+done:
+	if (ret > 0)
+		iocb->ki_pos += ret;
+out_unlock:
+	inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
 
-	sb = dir->i_sb;
-	inode = new_inode(sb);
-	if (!inode)
-		return ERR_PTR(-ENOMEM);
+/*
+ * Direct I/O.
+ *
+ * Reads and block-aligned overwrites of written blocks inside i_size
+ * run under the shared inode lock, so they go on in parallel.  Anything
+ * that may allocate, write unwritten blocks, zero part of a block or
+ * move i_size takes the lock exclusively.  The last two also wait for
+ * the I/O, so i_size is set by vsfs_dio_write_end_io() before the lock
+ * is dropped.  Blocks a direct write allocates or fills stay unwritten
+ * until vsfs_dio_write_end_io() knows the data is on disk.
+ */
+static bool vsfs_dio_overwrite(struct inode *inode, loff_t pos, size_t count)
+{
+	sector_t iblock = pos >> VSFS_BLKSHIFT;
+	sector_t end = (pos + count) >> VSFS_BLKSHIFT;
+	bool new, boundary, unwritten;
+	u32 bno;
+	int ret;
 
-	vsi = VSFS_I(inode);
-	sbi = VSFS_SB(sb);
+	if ((pos | count) & (VSFS_BLKSIZE - 1) || pos + count > i_size_read(inode) ||
+			vsfs_has_inline_data(inode))
+		return false;
+
+	while (iblock < end) {
+		new = boundary = unwritten = false;
+		ret = vsfs_get_blocks(inode, iblock, end - iblock, &bno, &new, &boundary,
+				&unwritten, 0);
+		if (ret <= 0 || unwritten)
+			return false;
+		iblock += ret;
+	}
+	return true;
+}
 
-	for (i = 0; i < VSFS_GET_SB(blkcnt_imap); i++) {
-		brelse(bitmap_bh);
-		bitmap_bh = sb_bread(sb, VSFS_GET_SB(imap_blkaddr) + i);
-		if (!bitmap_bh) {
-			err = -EIO;
-			goto failed;
-		}
-		ino = 0;
+/*
+ * Mark the blocks a direct write went to as written, now that its data is
+ * on disk.  Truncate and hole punching wait for direct I/O, so a hole met
+ * here can only be a block the write never reached.
+ */
+static int vsfs_dio_convert_unwritten(struct inode *inode, loff_t pos, ssize_t size)
+{
+	sector_t iblock = pos >> VSFS_BLKSHIFT;
+	sector_t end = (pos + size + VSFS_BLKSIZE - 1) >> VSFS_BLKSHIFT;
+	bool new, boundary, unwritten;
+	u32 bno;
+	int ret;
 
-		ino = find_next_zero_bit_le(bitmap_bh->b_data, VSFS_BLKSIZE, 0);
-		if (ino >= vsfs_max_bit(i + 1))
+	while (iblock < end) {
+		new = boundary = unwritten = false;
+		ret = vsfs_get_blocks(inode, iblock, end - iblock, &bno, &new, &boundary,
+				&unwritten, 0);
+		if (ret < 0)
+			return ret;
+		if (!ret) {
+			iblock++;
 			continue;
-		if (!test_and_set_bit_le(ino, bitmap_bh->b_data)) {
-			ino += vsfs_max_bit(i) + VSFS_ROOT_INO;
-			goto got;
 		}
+		if (unwritten) {
+			ret = vsfs_get_blocks(inode, iblock, ret, &bno, &new, &boundary,
+					&unwritten, VSFS_GET_BLOCKS_CREATE);
+			if (ret <= 0)
+				return ret ? ret : -EIO;
+		}
+		iblock += ret;
 	}
-	brelse(bitmap_bh);
-	err = -ENOSPC;
-	goto failed;
+	return 0;
+}
+
+static int vsfs_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error,
+		unsigned int flags)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	loff_t end = iocb->ki_pos + size;
+
+	if (error)
+		return error;
+	if (size && (flags & IOMAP_DIO_UNWRITTEN)) {
+		error = vsfs_dio_convert_unwritten(inode, iocb->ki_pos, size);
+		if (error)
+			return error;
+	}
+	if (size && end > i_size_read(inode)) {
+		i_size_write(inode, end);
+		mark_inode_dirty(inode);
+	}
+	return 0;
+}
 
-got:
-	mark_buffer_dirty(bitmap_bh);
-//	if (sb->s_flags & SB_SYNCHRONOUS)
-		sync_dirty_buffer(bitmap_bh);
-	brelse(bitmap_bh);
+static const struct iomap_dio_ops vsfs_dio_write_ops = {
+	.end_io		= vsfs_dio_write_end_io,
+};
 
-	if (ino < VSFS_ROOT_INO || ino > VSFS_GET_SB(blkcnt_inode) + VSFS_ROOT_INO) {
-		vsfs_msg(KERN_ERR, "vsfs_new_inode", "rserved inode or inode > inodes count");
-		err = -EIO;
-		goto failed;
+static ssize_t vsfs_dio_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock_shared(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock_shared(inode);
 	}
 
-	inode->i_ino = ino;
-	inode_init_owner(inode, dir, mode);
-	inode->i_blocks = 0;
-	inode->i_generation = 0;
-	inode->i_mtime = inode->i_atime = inode->i_ctime = current_time(inode);
-	vsi->i_flags = VSFS_I(dir)->i_flags;
-	vsi->i_dir_start_lookup = 0;
-	memset(&vsi->i_data, 0, sizeof(vsi->i_data));
-	if (insert_inode_locked(inode) < 0) {
-		err = -EIO;
-		goto failed;
+	/* inline data has no block to read from */
+	if (vsfs_has_inline_data(inode)) {
+		inode_unlock_shared(inode);
+		iocb->ki_flags &= ~IOCB_DIRECT;
+		return generic_file_read_iter(iocb, to);
 	}
 
-	mark_inode_dirty(inode);
+	file_accessed(iocb->ki_filp);
+	ret = iomap_dio_rw(iocb, to, &vsfs_iomap_ops, NULL, is_sync_kiocb(iocb));
+	inode_unlock_shared(inode);
+	return ret;
+}
 
-	bh = sb_bread(sb, vsfs_inotoba(inode->i_ino));
-	if (!bh) {
-		vsfs_msg(KERN_ERR, "vsfs_new_inode", "Failed to read inode %lu\n", inode->i_ino);
-		err = -EIO;
-		goto fail_remove_inode;
+static ssize_t vsfs_dio_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	bool shared, extend, unaligned;
+	loff_t pos, end;
+	size_t count;
+	ssize_t ret;
+
+	/* a guess without the lock, made good below */
+	shared = vsfs_dio_overwrite(inode, iocb->ki_pos, iov_iter_count(from));
+relock:
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (shared ? !inode_trylock_shared(inode) : !inode_trylock(inode))
+			return -EAGAIN;
+	} else if (shared) {
+		inode_lock_shared(inode);
+	} else {
+		inode_lock(inode);
 	}
-	vsfs_inode = (struct vsfs_inode *)bh->b_data;
-	ktime_get_real_ts64(&ts);
-	vsfs_inode->i_ctime = cpu_to_le64(ts.tv_sec);
-	vsfs_inode->i_ctime_nsec = cpu_to_le32(ts.tv_nsec);
-	mark_buffer_dirty(bh);
-	unlock_buffer(bh);
-//	if (sb->s_flags & SB_SYNCHRONOUS)
-		sync_dirty_buffer(bh);
-	brelse(bh);
 
-	return inode;
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out_unlock;
 
-fail_remove_inode:
-	clear_nlink(inode);
-	discard_new_inode(inode);
-	return ERR_PTR(err);
+	pos = iocb->ki_pos;
+	count = iov_iter_count(from);
+	end = pos + count;
+	unaligned = (pos | count) & (VSFS_BLKSIZE - 1);
+	extend = end > i_size_read(inode);
 
-failed:
-	make_bad_inode(inode);
-	iput(inode);
-	return ERR_PTR(err);
+	if (shared && (!IS_NOSEC(inode) || !vsfs_dio_overwrite(inode, pos, count))) {
+		inode_unlock_shared(inode);
+		shared = false;
+		goto relock;
+	}
+	if (!shared && (iocb->ki_flags & IOCB_NOWAIT)) {
+		/* allocation and conversion may block */
+		ret = -EAGAIN;
+		goto out_unlock;
+	}
+
+	ret = file_remove_privs(file);
+	if (ret)
+		goto out_unlock;
+	ret = file_update_time(file);
+	if (ret)
+		goto out_unlock;
+
+	if (vsfs_has_inline_data(inode)) {
+		ret = vsfs_convert_inline(inode, vsfs_write_get_block(inode));
+		if (ret)
+			goto out_unlock;
+	}
+
+	/* sub-block zeroing must not race with AIO still in flight on the same block */
+	if (unaligned)
+		inode_dio_wait(inode);
+
+	ret = iomap_dio_rw(iocb, from, &vsfs_iomap_ops, &vsfs_dio_write_ops,
+			is_sync_kiocb(iocb) || unaligned || extend);
+	/* the page cache could not be invalidated, the caller writes through it */
+	if (ret == -ENOTBLK)
+		ret = 0;
+	if (extend && ret < (ssize_t)count)
+		vsfs_write_failed(inode->i_mapping, end);
+
+out_unlock:
+	if (shared)
+		inode_unlock_shared(inode);
+	else
+		inode_unlock(inode);
+	return ret;
 }
 
-int vsfs_setattr(struct dentry *dentry, struct iattr *attr)
+static ssize_t vsfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	struct inode *inode = d_inode(dentry);
-	unsigned int ia_valid = attr->ia_valid;
+	if (!(iocb->ki_flags & IOCB_DIRECT))
+		return generic_file_read_iter(iocb, to);
+	if (!iov_iter_count(to))
+		return 0;
+	return vsfs_dio_read_iter(iocb, to);
+}
+
+static ssize_t vsfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct address_space *mapping = iocb->ki_filp->f_mapping;
+	ssize_t written, ret;
+	loff_t pos;
 	int err;
 
-	err= setattr_prepare(dentry, attr);
+	if (!(iocb->ki_flags & IOCB_DIRECT))
+		return vsfs_buffered_write_iter(iocb, from);
+
+	written = vsfs_dio_write_iter(iocb, from);
+	if (written < 0 || !iov_iter_count(from))
+		return written;
+
+	/* what direct I/O left over goes through the page cache and out again */
+	pos = iocb->ki_pos;
+	iocb->ki_flags &= ~IOCB_DIRECT;
+	ret = vsfs_buffered_write_iter(iocb, from);
+	iocb->ki_flags |= IOCB_DIRECT;
+	if (ret <= 0)
+		return written ? written : ret;
+
+	err = filemap_write_and_wait_range(mapping, pos, pos + ret - 1);
 	if (err)
-		return err;
+		return written ? written : err;
+	invalidate_mapping_pages(mapping, pos >> PAGE_SHIFT, (pos + ret - 1) >> PAGE_SHIFT);
+	return written + ret;
+}
 
-	if (ia_valid & ATTR_SIZE && attr->ia_size != inode->i_size) {
-		//err = sfs_truncate(inode, attr->ia_size);
-		if (err)
-			return err;
+/* an inline page just gets dirtied, ->writepage copies it back to the inode */
+static vm_fault_t vsfs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	struct page *page = vmf->page;
+	vm_fault_t ret = VM_FAULT_LOCKED;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+	if (!vsfs_has_inline_data(inode)) {
+		ret = iomap_page_mkwrite(vmf, &vsfs_iomap_ops);
+		goto out;
 	}
 
-	setattr_copy(inode, attr);
-	mark_inode_dirty(inode);
-	return err;
+	lock_page(page);
+	if (page->mapping != inode->i_mapping) {
+		unlock_page(page);
+		ret = VM_FAULT_NOPAGE;
+		goto out;
+	}
+	set_page_dirty(page);
+	wait_for_stable_page(page);
+out:
+	sb_end_pagefault(inode->i_sb);
+	return ret;
 }
 
-const struct inode_operations vsfs_file_inode_operations = {
-		.setattr = vsfs_setattr,
+static const struct vm_operations_struct vsfs_file_vm_ops = {
+	.fault		= filemap_fault,
+	.map_pages	= filemap_map_pages,
+	.page_mkwrite	= vsfs_page_mkwrite,
 };
 
+static int vsfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (!vsfs_use_iomap(file_inode(file)))
+		return generic_file_mmap(file, vma);
+
+	file_accessed(file);
+	vma->vm_ops = &vsfs_file_vm_ops;
+	return 0;
+}
+
+static loff_t vsfs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file->f_mapping->host;
+
+	if (!vsfs_use_iomap(inode) || (whence != SEEK_HOLE && whence != SEEK_DATA))
+		return generic_file_llseek(file, offset, whence);
+
+	inode_lock_shared(inode);
+	if (whence == SEEK_HOLE)
+		offset = iomap_seek_hole(inode, offset, &vsfs_iomap_ops);
+	else
+		offset = iomap_seek_data(inode, offset, &vsfs_iomap_ops);
+	inode_unlock_shared(inode);
+	if (offset < 0)
+		return offset;
+	return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
 const struct file_operations vsfs_file_operations = {
-	.llseek		= generic_file_llseek,
-	.read_iter	= generic_file_read_iter,
-	.write_iter	= generic_file_write_iter,
-	.mmap		= generic_file_mmap,
+	.llseek		= vsfs_file_llseek,
+	.read_iter	= vsfs_file_read_iter,
+	.write_iter	= vsfs_file_write_iter,
+	.mmap		= vsfs_file_mmap,
 	.open		= generic_file_open,
-	.fsync		= generic_file_fsync,
+	.release	= vsfs_release_file,
+	.unlocked_ioctl	= vsfs_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
+	.fsync		= vsfs_fsync,
 	.splice_read	= generic_file_splice_read,
+	.fallocate	= vsfs_fallocate,
 };
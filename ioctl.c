@@ -0,0 +1,50 @@
+/*
+ * ioctl.c
+ *
+ * 2021 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/uaccess.h>
+
+#include "vsfs_fs.h"
+#include "vsfs.h"
+
+static int vsfs_ioc_fitrim(struct super_block *sb, struct fstrim_range __user *arg)
+{
+	struct request_queue *q = bdev_get_queue(sb->s_bdev);
+	struct fstrim_range range;
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (!blk_queue_discard(q))
+		return -EOPNOTSUPP;
+
+	if (copy_from_user(&range, arg, sizeof(range)))
+		return -EFAULT;
+
+	range.minlen = max_t(u64, range.minlen, q->limits.discard_granularity);
+	ret = vsfs_trim_fs(sb, &range);
+	if (ret < 0)
+		return ret;
+
+	if (copy_to_user(arg, &range, sizeof(range)))
+		return -EFAULT;
+	return 0;
+}
+
+long vsfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct inode *inode = file_inode(filp);
+
+	switch (cmd) {
+	case FITRIM:
+		return vsfs_ioc_fitrim(inode->i_sb, (struct fstrim_range __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
@@ -0,0 +1,203 @@
+/*
+ * mapcache.c
+ *
+ * 2021 Lee JeYeon., Dankook Univ.
+ *		2reenact@gmail.com
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+
+#include "vsfs_fs.h"
+#include "vsfs.h"
+
+/*
+ * Per-inode cache of written runs vsfs_get_blocks() has resolved, so a
+ * block mapped once is not looked up through the indirect chain or the
+ * extent tree again.  Holes and unwritten runs are never cached, which
+ * leaves allocation free to fill them without touching the cache; only
+ * truncate, hole punching and zeroing take runs away.
+ *
+ * A lookup done without truncate_mutex may race with one of those, so
+ * every removal bumps i_map_seq and a run is only added if the sequence
+ * has not moved since its lookup started.
+ */
+
+struct vsfs_map_entry {
+	struct rb_node me_node;				/* in i_map_tree, by me_lblk */
+	struct list_head me_lru;			/* in i_map_lru, oldest first */
+	sector_t me_lblk;
+	unsigned int me_len;
+	unsigned int me_pblk;
+};
+
+static struct kmem_cache *vsfs_map_cachep;
+
+static inline sector_t vsfs_map_end(struct vsfs_map_entry *me)
+{
+	return me->me_lblk + me->me_len;
+}
+
+/* the entry holding @lblk or else the first one after it */
+static struct vsfs_map_entry *vsfs_map_next(struct vsfs_inode_info *vsi, sector_t lblk)
+{
+	struct rb_node *n = vsi->i_map_tree.rb_node;
+	struct vsfs_map_entry *me, *next = NULL;
+
+	while (n) {
+		me = rb_entry(n, struct vsfs_map_entry, me_node);
+		if (lblk < me->me_lblk) {
+			next = me;
+			n = n->rb_left;
+		} else if (lblk >= vsfs_map_end(me)) {
+			n = n->rb_right;
+		} else {
+			return me;
+		}
+	}
+	return next;
+}
+
+static void vsfs_map_erase(struct vsfs_inode_info *vsi, struct vsfs_map_entry *me)
+{
+	rb_erase(&me->me_node, &vsi->i_map_tree);
+	list_del(&me->me_lru);
+	vsi->i_map_count--;
+	kmem_cache_free(vsfs_map_cachep, me);
+}
+
+unsigned int vsfs_map_cache_seq(struct inode *inode)
+{
+	return READ_ONCE(VSFS_I(inode)->i_map_seq);
+}
+
+void vsfs_map_cache_init(struct inode *inode)
+{
+	struct vsfs_inode_info *vsi = VSFS_I(inode);
+
+	vsi->i_map_tree = RB_ROOT;
+	INIT_LIST_HEAD(&vsi->i_map_lru);
+	vsi->i_map_count = 0;
+	vsi->i_map_seq = 0;
+}
+
+/* up to @maxblocks blocks of the cached run holding @lblk, 0 on a miss */
+int vsfs_map_cache_lookup(struct inode *inode, sector_t lblk, unsigned long maxblocks, u32 *bno)
+{
+	struct vsfs_inode_info *vsi = VSFS_I(inode);
+	struct vsfs_map_entry *me;
+	int count = 0;
+
+	spin_lock(&vsi->i_map_lock);
+	me = vsfs_map_next(vsi, lblk);
+	if (me && me->me_lblk <= lblk) {
+		*bno = me->me_pblk + (lblk - me->me_lblk);
+		count = min_t(unsigned long, maxblocks, vsfs_map_end(me) - lblk);
+		list_move_tail(&me->me_lru, &vsi->i_map_lru);
+	}
+	spin_unlock(&vsi->i_map_lock);
+	return count;
+}
+
+/*
+ * Remember that @len blocks from @lblk are written at @pblk, unless runs
+ * were removed since @seq was read.  A run that continues a cached one
+ * is merged into it.
+ */
+void vsfs_map_cache_insert(struct inode *inode, unsigned int seq, sector_t lblk,
+		unsigned int len, unsigned int pblk)
+{
+	struct vsfs_inode_info *vsi = VSFS_I(inode);
+	struct rb_node **p, *parent = NULL;
+	struct vsfs_map_entry *me, *prev;
+	struct rb_node *n;
+
+	spin_lock(&vsi->i_map_lock);
+	if (vsi->i_map_seq != seq)
+		goto out;
+
+	/* what is cached already of the run stays as it is */
+	me = vsfs_map_next(vsi, lblk);
+	if (me && me->me_lblk <= lblk)
+		goto out;
+	if (me && me->me_lblk < lblk + len)
+		len = me->me_lblk - lblk;
+
+	n = me ? rb_prev(&me->me_node) : rb_last(&vsi->i_map_tree);
+	prev = n ? rb_entry(n, struct vsfs_map_entry, me_node) : NULL;
+	if (prev && vsfs_map_end(prev) == lblk && prev->me_pblk + prev->me_len == pblk &&
+			prev->me_len + len > prev->me_len) {
+		prev->me_len += len;
+		list_move_tail(&prev->me_lru, &vsi->i_map_lru);
+		goto out;
+	}
+
+	if (vsi->i_map_count >= VSFS_MAP_CACHE_MAX)
+		vsfs_map_erase(vsi, list_first_entry(&vsi->i_map_lru,
+					struct vsfs_map_entry, me_lru));
+
+	me = kmem_cache_alloc(vsfs_map_cachep, GFP_NOWAIT | __GFP_NOWARN);
+	if (!me)
+		goto out;
+	me->me_lblk = lblk;
+	me->me_len = len;
+	me->me_pblk = pblk;
+
+	p = &vsi->i_map_tree.rb_node;
+	while (*p) {
+		parent = *p;
+		if (lblk < rb_entry(parent, struct vsfs_map_entry, me_node)->me_lblk)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&me->me_node, parent, p);
+	rb_insert_color(&me->me_node, &vsi->i_map_tree);
+	list_add_tail(&me->me_lru, &vsi->i_map_lru);
+	vsi->i_map_count++;
+out:
+	spin_unlock(&vsi->i_map_lock);
+}
+
+/* forget the mappings of blocks [@start, @end), before they are freed or changed */
+void vsfs_map_cache_remove(struct inode *inode, sector_t start, sector_t end)
+{
+	struct vsfs_inode_info *vsi = VSFS_I(inode);
+	struct vsfs_map_entry *me;
+	struct rb_node *n;
+
+	spin_lock(&vsi->i_map_lock);
+	vsi->i_map_seq++;
+	me = vsfs_map_next(vsi, start);
+	while (me && me->me_lblk < end) {
+		n = rb_next(&me->me_node);
+		if (me->me_lblk < start) {
+			/* a run around the whole range loses its right part too */
+			me->me_len = start - me->me_lblk;
+		} else if (vsfs_map_end(me) > end) {
+			me->me_pblk += end - me->me_lblk;
+			me->me_len = vsfs_map_end(me) - end;
+			me->me_lblk = end;
+		} else {
+			vsfs_map_erase(vsi, me);
+		}
+		me = n ? rb_entry(n, struct vsfs_map_entry, me_node) : NULL;
+	}
+	spin_unlock(&vsi->i_map_lock);
+}
+
+int __init vsfs_init_map_cache(void)
+{
+	vsfs_map_cachep = kmem_cache_create("vsfs_map_entry",
+				sizeof(struct vsfs_map_entry), 0,
+				SLAB_RECLAIM_ACCOUNT, NULL);
+	if (vsfs_map_cachep == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+void vsfs_destroy_map_cache(void)
+{
+	kmem_cache_destroy(vsfs_map_cachep);
+}
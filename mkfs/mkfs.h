@@ -38,6 +38,8 @@ static int sfs_prepare_super_block(void);
 static int sfs_add_default_dentry_root(void);
 static int sfs_write_root_inode(void);
 static int sfs_create_root_dir(void);
+static int sfs_init_bitmaps(void);
+static int sfs_write_group_desc(void);
 static int sfs_write_super_block(void);
 int sfs_format_device(void);
 
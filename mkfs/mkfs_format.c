@@ -58,7 +58,8 @@ static int sfs_prepare_super_block(void) {
         u_int32_t inodes_blkaddr, data_blkaddr;
         u_int32_t block_count_imap, block_count_dmap;
         u_int32_t block_count_inodes, block_count_data;
-        u_int32_t root_addr;
+        u_int32_t gdt_blkaddr, block_count_gdt;
+        u_int32_t root_addr, inode_count, inodes_per_block;
 
         set_sb(magic, SFS_SUPER_MAGIC);
 
@@ -75,21 +76,38 @@ static int sfs_prepare_super_block(void) {
 	set_sb(start_block_addr, c.start_blkaddr);
 	memcpy(sb->path, c.path, MAX_PATH_LEN);
 
-	imap_blkaddr = SFS_IMAP_BLK_OFFSET;
-	set_sb(imap_blkaddr, imap_blkaddr);
+	set_sb(rev_level, SFS_PACKED_REV);
+	set_sb(inode_size, c.inode_size);
 
+	/* the inode table is rounded up to whole blocks of packed inodes */
 	total_block_count = total_block_count - 2;
-	block_count_inodes = total_block_count >> log_base_2(SFS_NODE_RATIO);
-	block_count_imap = MAP_SIZE_ALIGN(block_count_inodes);
+	inodes_per_block = SFS_BLKSIZE / c.inode_size;
+	inode_count = total_block_count >> log_base_2(SFS_NODE_RATIO);
+	block_count_inodes = (inode_count + inodes_per_block - 1) / inodes_per_block;
+	inode_count = block_count_inodes * inodes_per_block;
+	block_count_imap = MAP_SIZE_ALIGN(inode_count);
 	set_sb(block_count_imap, block_count_imap);
 
+	/* one descriptor per dmap block, sized for the most data we could have */
+	gdt_blkaddr = SFS_GDT_BLK_OFFSET;
+	block_count_gdt = SFS_BLOCK_ALIGN(MAP_SIZE_ALIGN(total_block_count) *
+					sizeof(struct sfs_group_desc));
+	set_sb(gdt_blkaddr, gdt_blkaddr);
+	set_sb(block_count_gdt, block_count_gdt);
+
+	imap_blkaddr = gdt_blkaddr + block_count_gdt;
+	set_sb(imap_blkaddr, imap_blkaddr);
+
 	dmap_blkaddr = imap_blkaddr + block_count_imap;
 	set_sb(dmap_blkaddr,dmap_blkaddr);
 
-	total_block_count = total_block_count - (block_count_imap + block_count_inodes);
+	total_block_count = total_block_count -
+		(block_count_gdt + block_count_imap + block_count_inodes);
 	block_count_data = SFS_BLKSIZE * (1 + total_block_count) / (SFS_BLKSIZE + 1);
 	block_count_dmap = MAP_SIZE_ALIGN(block_count_data);
 	set_sb(block_count_dmap, block_count_dmap);
+	set_sb(group_count, block_count_dmap);
+	set_sb(state, SFS_VALID_FS);
 
 	inodes_blkaddr = dmap_blkaddr + block_count_dmap;
 	set_sb(inodes_blkaddr, inodes_blkaddr);
@@ -308,6 +326,91 @@ static int sfs_update_maps_root(void)
 	return err;
 }
 
+static int sfs_init_bitmaps(void)
+{
+	char *zero_blk = NULL;
+	u_int64_t blkaddr, end;
+
+	zero_blk = calloc(SFS_BLKSIZE, 1);
+	if (zero_blk == NULL) {
+		MSG(1, "\tError: Calloc Failed for zero_blk!!!\n");
+		return -1;
+	}
+
+	/* imap and dmap are adjacent */
+	blkaddr = get_sb(imap_blkaddr);
+	end = get_sb(dmap_blkaddr) + get_sb(block_count_dmap);
+	for (; blkaddr < end; blkaddr++) {
+		if (dev_write_block(zero_blk, blkaddr)) {
+			MSG(1, "\tError: While clearing bitmap block %lu!!!\n", blkaddr);
+			free(zero_blk);
+			return -1;
+		}
+	}
+
+	free(zero_blk);
+	return 0;
+}
+
+static u_int32_t sfs_group_bits(u_int32_t total, u_int32_t group)
+{
+	u_int64_t start = (u_int64_t)group * SFS_BITS_PER_BLK;
+
+	if (start >= total)
+		return 0;
+	return min((u_int64_t)SFS_BITS_PER_BLK, total - start);
+}
+
+static int sfs_write_group_desc(void)
+{
+	struct sfs_group_desc *gdt = NULL;
+	u_int32_t group_count = get_sb(group_count);
+	u_int32_t free_blocks, free_inodes, used_dirs;
+	u_int32_t blk, i, g = 0;
+
+	gdt = calloc(SFS_BLKSIZE, 1);
+	if (gdt == NULL) {
+		MSG(1, "\tError: Calloc Failed for gdt!!!\n");
+		return -1;
+	}
+
+	for (blk = 0; blk < get_sb(block_count_gdt); blk++) {
+		memset(gdt, 0, SFS_BLKSIZE);
+		for (i = 0; i < SFS_DESC_PER_BLK && g < group_count; i++, g++) {
+			free_blocks = sfs_group_bits(get_sb(block_count_data), g);
+			free_inodes = 0;
+			used_dirs = 0;
+
+			gdt[i].dmap_blkaddr = cpu_to_le32(get_sb(dmap_blkaddr) + g);
+			if (g < get_sb(block_count_imap)) {
+				gdt[i].imap_blkaddr = cpu_to_le32(get_sb(imap_blkaddr) + g);
+				free_inodes = sfs_group_bits(get_sb(block_count_inodes) *
+						(SFS_BLKSIZE / get_sb(inode_size)), g);
+			}
+
+			/* the root directory owns the first inode and data block */
+			if (g == 0) {
+				free_blocks--;
+				free_inodes--;
+				used_dirs++;
+			}
+
+			gdt[i].free_blocks_count = cpu_to_le32(free_blocks);
+			gdt[i].free_inodes_count = cpu_to_le32(free_inodes);
+			gdt[i].used_dirs_count = cpu_to_le32(used_dirs);
+		}
+
+		if (dev_write_block(gdt, get_sb(gdt_blkaddr) + blk)) {
+			MSG(1, "\tError: While writing the gdt to disk!!!\n");
+			free(gdt);
+			return -1;
+		}
+	}
+
+	free(gdt);
+	return 0;
+}
+
 static int sfs_create_root_dir(void)
 {
 	int err = 0;
@@ -379,12 +482,24 @@ int sfs_format_device(void)
                 }
         }
 
+        err = sfs_init_bitmaps();
+        if (err < 0) {
+                MSG(0, "\tError: Failed to initialize bitmaps!!!\n");
+                goto exit;
+        }
+
         err = sfs_create_root_dir();
         if (err < 0) {
                 MSG(0, "\tError: Failed to create the root directory!!!\n");
                 goto exit;
         }
 
+        err = sfs_write_group_desc();
+        if (err < 0) {
+                MSG(0, "\tError: Failed to write group descriptors!!!\n");
+                goto exit;
+        }
+
         err = sfs_write_super_block();
         if (err < 0) {
                 MSG(0, "\tError: Failed to write the super block!!!\n");
@@ -35,6 +35,7 @@ static void mkfs_usage(void) {
 	MSG(0, "[options]:\n");
 	MSG(0, "  -a heap-based allocation [default:0]\n");
 	MSG(0, "  -d debug level [default:0]\n");
+	MSG(0, "  -I inode size in bytes [default:%d]\n", SFS_DEF_INODE_SIZE);
 	MSG(0, "  -l label\n");
 	exit(1);
 }
@@ -48,6 +49,7 @@ static void sfs_show_info(void) {
 		MSG(0, "Info: Disable heap-based policy\n");
 
 	MSG(0, "Info: Debug level = %d\n", c.dbg_lv);
+	MSG(0, "Info: Inode size = %u\n", c.inode_size);
 
 	if (strlen(c.vol_label))
 		MSG(0, "Info: Lable = %s\n", c.vol_label);
@@ -64,6 +66,7 @@ void sfs_init_configuration(void)
         c.trim = 1;
         c.sector_size = DEFAULT_SECTOR_SIZE;
         c.sectors_per_block = DEFAULT_SECTORS_PER_BLOCK;
+        c.inode_size = SFS_DEF_INODE_SIZE;
         c.vol_label = "";
         c.path = NULL;
 
@@ -73,10 +76,10 @@ void sfs_init_configuration(void)
 
 static void sfs_parse_options(int argc, char *argv[])
 {
-        static const char *option_string = "a:d:l:";
+        static const char *option_string = "a:d:I:l:";
         int32_t option=0;
 
-        while ((option = getopt(argc, argv, option_string) != EOF)) {
+        while ((option = getopt(argc, argv, option_string)) != EOF) {
                 switch (option) {
                 case 'a':
 //			config.heap = atoi(optarg);
@@ -87,6 +90,17 @@ static void sfs_parse_options(int argc, char *argv[])
 			c.dbg_lv = atoi(optarg);
 			MSG(0, "Info: Debug level = %d\n", c.dbg_lv);
                         break;
+		case 'I':
+			c.inode_size = atoi(optarg);
+			if (c.inode_size < sizeof(struct sfs_inode) ||
+					c.inode_size > SFS_BLKSIZE ||
+					(c.inode_size & (c.inode_size - 1))) {
+				MSG(0, "\tError: Inode size should be a power of 2 "
+					"between %zu and %d\n",
+					sizeof(struct sfs_inode), SFS_BLKSIZE);
+				mkfs_usage();
+			}
+			break;
                 case 'l':
                         if (strlen(optarg) > 512) {
                                 MSG(0, "Error: Volume Label should be less than\
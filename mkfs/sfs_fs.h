@@ -164,7 +164,7 @@ static inline u_int64_t bswap_64(u_int64_t val)
 #define PAGE_CACHE_SIZE		4096
 #define BITS_PER_BYTE		8
 #define SFS_SUPER_MAGIC		0x202105F5	/* SFS Magic Number */
-#define MAX_PATH_LEN		24
+#define MAX_PATH_LEN		32
 
 #define SFS_BYTES_TO_BLK(bytes)    ((bytes) >> SFS_BLKSIZE_BITS)
 #define SFS_BLKSIZE_BITS	12
@@ -181,6 +181,7 @@ struct sfs_configuration {
 	u_int64_t end_blkaddr;
 	u_int64_t total_sectors;
 	u_int32_t total_blocks;
+	u_int32_t inode_size;
 
 	char *vol_label;
 	char *path;
@@ -265,8 +266,35 @@ struct sfs_super_block {
 	__le32 block_count_data;        /* # of blocks for data */
 	__le32 root_addr;               /* root inode blkaddr */
 	char path[MAX_PATH_LEN];
+	__le32 gdt_blkaddr;             /* start block address of group descriptors */
+	__le32 block_count_gdt;         /* # of blocks for group descriptors */
+	__le32 group_count;             /* # of block groups */
+	__le16 state;                   /* file system state */
+	__le16 rev_level;               /* on-disk format revision */
+	__le16 inode_size;              /* bytes per on-disk inode, SFS_PACKED_REV on */
 } __attribute__((packed));
 
+#define SFS_VALID_FS		0x0001	/* cleanly unmounted */
+
+#define SFS_OLD_REV		0	/* one inode per inode-table block */
+#define SFS_PACKED_REV		1	/* inode_size bytes per inode */
+#define SFS_DEF_INODE_SIZE	256
+
+/*
+ * Group g owns dmap block g, the data blocks it describes and, while
+ * g < block_count_imap, imap block g with the inodes it describes.
+ */
+struct sfs_group_desc {
+	__le32 dmap_blkaddr;            /* block address of the group's data bmap */
+	__le32 imap_blkaddr;            /* block address of the group's inode bmap, 0 if none */
+	__le32 free_blocks_count;       /* # of free data blocks */
+	__le32 free_inodes_count;       /* # of free inodes */
+	__le32 used_dirs_count;         /* # of directories */
+	__le32 reserved[3];
+} __attribute__((packed));
+
+#define SFS_DESC_PER_BLK	(SFS_BLKSIZE / sizeof(struct sfs_group_desc))
+
 #define DEF_ADDRS_PER_INODE     12      /* Address Pointers in an Inode */
 #define DEF_NIDS_PER_INODE      3       /* Node IDs in an Inode */
 #define DEF_ADDRS_PER_BLOCK     1024    /* Address Pointers in a Indirect Block */
@@ -325,8 +353,10 @@ enum {
 	SFS_DIR,
 };
 
+#define SFS_GDT_BLK_OFFSET		2	/* group descriptors follow the super blocks */
 #define SFS_IMAP_BLK_OFFSET		2	/* imap block offset is 1 */
 #define SFS_IMAP_BYTE_OFFSET		4096	/* imap byte offset is 4096 */
+#define SFS_BITS_PER_BLK		(BITS_PER_BYTE * SFS_BLKSIZE)
 #define MAP_SIZE_ALIGN(size)		((((size + BITS_PER_BYTE - 1) / BITS_PER_BYTE) + SFS_BLKSIZE) / SFS_BLKSIZE)
 
 #define SFS_NODE_RATIO			128	/* node : data ratio is 1 : 128 */
@@ -47,7 +47,7 @@ static int vsfs_create(struct inode *dir, struct dentry *dentry, umode_t mode, b
 
 	inode->i_op = &vsfs_file_inode_operations;
 	inode->i_fop = &vsfs_file_operations;
-	inode->i_mapping->a_ops = &vsfs_aops;
+	inode->i_mapping->a_ops = vsfs_use_iomap(inode) ? &vsfs_iomap_aops : &vsfs_aops;
 	mark_inode_dirty(inode);
 	return vsfs_add_nondir(dentry, inode);
 }
@@ -13,6 +13,10 @@
 #include <linux/mount.h>
 #include <linux/iversion.h>
 #include <linux/writeback.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/blkdev.h>
+#include <linux/log2.h>
 
 #include "vsfs.h"
 
@@ -30,10 +34,148 @@ void vsfs_msg(const char *level, const char *funtion, const char *fmt, ...)
 
 static const struct super_operations vsfs_sops;
 
+static void vsfs_commit_super(struct super_block *sb, int wait)
+{
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+	struct buffer_head *bh;
+	int block;
+
+	for (block = 0; block < 2; block++) {
+		bh = sb_bread(sb, block);
+		if (!bh) {
+			vsfs_msg(KERN_ERR, "vsfs_commit_super", "Failed to read %dth superblock", block + 1);
+			continue;
+		}
+		lock_buffer(bh);
+		memcpy(bh->b_data + VSFS_SUPER_OFFSET, sbi->raw_super, sizeof(*sbi->raw_super));
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		if (wait)
+			sync_dirty_buffer(bh);
+		brelse(bh);
+	}
+}
+
+/*
+ * Copy the in-memory group counts back to the group descriptor table.
+ * Old images without a table keep them in memory only.
+ */
+void vsfs_commit_groups(struct super_block *sb, int wait)
+{
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+	struct vsfs_group_desc *desc;
+	struct vsfs_group_info *grp;
+	struct buffer_head *bh;
+	unsigned int i, g = 0;
+
+	if (!sbi->gdt_blkaddr)
+		return;
+
+	for (i = 0; i < sbi->blkcnt_gdt && g < sbi->group_count; i++) {
+		bh = sb_bread(sb, sbi->gdt_blkaddr + i);
+		if (!bh) {
+			vsfs_msg(KERN_ERR, "vsfs_commit_groups", "Failed to read gdt block %u", i);
+			g += VSFS_DESC_PER_BLK;
+			continue;
+		}
+
+		lock_buffer(bh);
+		desc = (struct vsfs_group_desc *)bh->b_data;
+		for (; desc < (struct vsfs_group_desc *)bh->b_data + VSFS_DESC_PER_BLK &&
+				g < sbi->group_count; desc++, g++) {
+			grp = vsfs_get_group(sbi, g);
+			spin_lock(&grp->lock);
+			desc->free_blocks_count = cpu_to_le32(grp->free_blocks);
+			desc->free_inodes_count = cpu_to_le32(grp->free_inodes);
+			desc->used_dirs_count = cpu_to_le32(grp->used_dirs);
+			spin_unlock(&grp->lock);
+		}
+		unlock_buffer(bh);
+
+		mark_buffer_dirty(bh);
+		if (wait)
+			sync_dirty_buffer(bh);
+		brelse(bh);
+	}
+}
+
+static int vsfs_write_bitmap(struct super_block *sb, unsigned int blkaddr, int wait)
+{
+	struct buffer_head *bh;
+	int err = 0;
+
+	/* not cached any more means it has been written */
+	bh = sb_find_get_block(sb, blkaddr);
+	if (!bh)
+		return 0;
+	if (wait)
+		err = sync_dirty_buffer(bh);
+	else
+		write_dirty_buffer(bh, 0);
+	brelse(bh);
+	return err;
+}
+
+/*
+ * Write back the bitmap blocks allocation has dirtied.  Only a waiting
+ * call clears the dirty marks, so a non-waiting one followed by a waiting
+ * one still waits for everything.
+ */
+int vsfs_sync_bitmaps(struct super_block *sb, int wait)
+{
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+	struct vsfs_group_info *grp;
+	unsigned int g;
+	int err, ret = 0;
+
+	for (g = 0; g < sbi->group_count; g++) {
+		grp = vsfs_get_group(sbi, g);
+		if (wait ? test_and_clear_bit(VSFS_GRP_DMAP_DIRTY, &grp->state) :
+				test_bit(VSFS_GRP_DMAP_DIRTY, &grp->state)) {
+			err = vsfs_write_bitmap(sb, sbi->dmap_blkaddr + g, wait);
+			if (err && !ret)
+				ret = err;
+		}
+		if (wait ? test_and_clear_bit(VSFS_GRP_IMAP_DIRTY, &grp->state) :
+				test_bit(VSFS_GRP_IMAP_DIRTY, &grp->state)) {
+			err = vsfs_write_bitmap(sb, sbi->imap_blkaddr + g, wait);
+			if (err && !ret)
+				ret = err;
+		}
+	}
+	return ret;
+}
+
+static void vsfs_destroy_groups(struct vsfs_sb_info *sbi)
+{
+	percpu_counter_destroy(&sbi->free_blocks_counter);
+	percpu_counter_destroy(&sbi->free_inodes_counter);
+	percpu_counter_destroy(&sbi->dirs_counter);
+	percpu_counter_destroy(&sbi->dirty_blocks_counter);
+	free_percpu(sbi->ino_pools);
+	sbi->ino_pools = NULL;
+	vsfs_drop_free_extents(sbi);
+	kvfree(sbi->groups);
+	sbi->groups = NULL;
+}
+
 static void vsfs_put_super(struct super_block *sb)
 {
 	struct vsfs_sb_info *sbi = VSFS_SB(sb);
 
+	if (!sb_rdonly(sb)) {
+		vsfs_flush_discards(sb);
+		vsfs_drain_ino_pools(sb);
+	}
+	cancel_delayed_work_sync(&sbi->discard_work);
+	if (!sb_rdonly(sb) && sbi->gdt_blkaddr) {
+		vsfs_sync_bitmaps(sb, 1);
+		vsfs_commit_groups(sb, 1);
+		sbi->raw_super->state = cpu_to_le16(le16_to_cpu(sbi->raw_super->state) | VSFS_VALID_FS);
+		vsfs_commit_super(sb, 1);
+	}
+
+	vsfs_destroy_groups(sbi);
 	kvfree(sbi->raw_super);
 	kvfree(sbi);
 
@@ -76,7 +218,145 @@ static int vsfs_read_raw_super(struct vsfs_sb_info *sbi, struct vsfs_super_block
 	return err;
 }
 
-static void vsfs_init_sb_info(struct vsfs_sb_info *sbi, struct vsfs_super_block *raw_super)
+/*
+ * Count the free bits of every group straight from the bitmaps.  Needed for
+ * images without a group descriptor table and after an unclean unmount,
+ * when the table may be stale.  Directory counts are not in the bitmaps;
+ * they restart from zero, which only skews where new directories go.
+ */
+static int vsfs_scan_groups(struct vsfs_sb_info *sbi)
+{
+	struct super_block *sb = sbi->sb;
+	struct vsfs_group_info *grp;
+	struct buffer_head *bh;
+	unsigned int g, bits;
+
+	for (g = 0; g < sbi->group_count; g++) {
+		grp = vsfs_get_group(sbi, g);
+
+		bits = vsfs_group_data_bits(sbi, g);
+		if (bits) {
+			bh = sb_bread(sb, sbi->dmap_blkaddr + g);
+			if (!bh)
+				goto failed_read;
+			grp->free_blocks = bits - bitmap_weight((unsigned long *)bh->b_data, bits);
+			brelse(bh);
+		}
+
+		bits = vsfs_group_inode_bits(sbi, g);
+		if (bits) {
+			bh = sb_bread(sb, sbi->imap_blkaddr + g);
+			if (!bh)
+				goto failed_read;
+			grp->free_inodes = bits - bitmap_weight((unsigned long *)bh->b_data, bits);
+			brelse(bh);
+		}
+	}
+	return 0;
+
+failed_read:
+	vsfs_msg(KERN_ERR, "vsfs_scan_groups", "Failed to read bitmaps of group %u", g);
+	return -EIO;
+}
+
+static int vsfs_read_group_desc(struct vsfs_sb_info *sbi)
+{
+	struct super_block *sb = sbi->sb;
+	struct vsfs_group_desc *desc;
+	struct vsfs_group_info *grp;
+	struct buffer_head *bh;
+	unsigned int i, g = 0;
+
+	for (i = 0; i < sbi->blkcnt_gdt && g < sbi->group_count; i++) {
+		bh = sb_bread(sb, sbi->gdt_blkaddr + i);
+		if (!bh) {
+			vsfs_msg(KERN_ERR, "vsfs_read_group_desc", "Failed to read gdt block %u", i);
+			return -EIO;
+		}
+
+		desc = (struct vsfs_group_desc *)bh->b_data;
+		for (; desc < (struct vsfs_group_desc *)bh->b_data + VSFS_DESC_PER_BLK &&
+				g < sbi->group_count; desc++, g++) {
+			if (le32_to_cpu(desc->dmap_blkaddr) != sbi->dmap_blkaddr + g) {
+				vsfs_msg(KERN_ERR, "vsfs_read_group_desc", "Corrupt descriptor for group %u", g);
+				brelse(bh);
+				return -EINVAL;
+			}
+			grp = vsfs_get_group(sbi, g);
+			grp->free_blocks = le32_to_cpu(desc->free_blocks_count);
+			grp->free_inodes = le32_to_cpu(desc->free_inodes_count);
+			grp->used_dirs = le32_to_cpu(desc->used_dirs_count);
+		}
+		brelse(bh);
+	}
+
+	if (g < sbi->group_count) {
+		vsfs_msg(KERN_ERR, "vsfs_read_group_desc", "Group descriptor table too short");
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int vsfs_load_groups(struct vsfs_sb_info *sbi)
+{
+	struct vsfs_super_block *raw_super = sbi->raw_super;
+	unsigned long free_blocks = 0, free_inodes = 0, dirs = 0;
+	unsigned int g;
+	int cpu, err;
+
+	sbi->groups = kvcalloc(sbi->group_count, sizeof(struct vsfs_group_info), GFP_KERNEL);
+	if (!sbi->groups)
+		return -ENOMEM;
+	for (g = 0; g < sbi->group_count; g++)
+		spin_lock_init(&sbi->groups[g].lock);
+
+	if (sbi->gdt_blkaddr && (le16_to_cpu(raw_super->state) & VSFS_VALID_FS))
+		err = vsfs_read_group_desc(sbi);
+	else
+		err = vsfs_scan_groups(sbi);
+	if (err)
+		goto failed_load;
+
+	for (g = 0; g < sbi->group_count; g++) {
+		free_blocks += sbi->groups[g].free_blocks;
+		free_inodes += sbi->groups[g].free_inodes;
+		dirs += sbi->groups[g].used_dirs;
+	}
+
+	err = percpu_counter_init(&sbi->free_blocks_counter, free_blocks, GFP_KERNEL);
+	if (!err)
+		err = percpu_counter_init(&sbi->free_inodes_counter, free_inodes, GFP_KERNEL);
+	if (!err)
+		err = percpu_counter_init(&sbi->dirs_counter, dirs, GFP_KERNEL);
+	if (!err)
+		err = percpu_counter_init(&sbi->dirty_blocks_counter, 0, GFP_KERNEL);
+	if (err) {
+		percpu_counter_destroy(&sbi->free_blocks_counter);
+		percpu_counter_destroy(&sbi->free_inodes_counter);
+		percpu_counter_destroy(&sbi->dirs_counter);
+		goto failed_load;
+	}
+
+	sbi->ino_pools = alloc_percpu(struct vsfs_ino_pool);
+	if (!sbi->ino_pools) {
+		percpu_counter_destroy(&sbi->free_blocks_counter);
+		percpu_counter_destroy(&sbi->free_inodes_counter);
+		percpu_counter_destroy(&sbi->dirs_counter);
+		percpu_counter_destroy(&sbi->dirty_blocks_counter);
+		err = -ENOMEM;
+		goto failed_load;
+	}
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(sbi->ino_pools, cpu)->lock);
+	return 0;
+
+failed_load:
+	kvfree(sbi->groups);
+	sbi->groups = NULL;
+	return err;
+}
+
+static int vsfs_init_sb_info(struct vsfs_sb_info *sbi, struct vsfs_super_block *raw_super)
 {
 	sbi->dmap_start_lookup = 0;
 	sbi->imap_start_lookup = 0;
@@ -84,11 +364,147 @@ static void vsfs_init_sb_info(struct vsfs_sb_info *sbi, struct vsfs_super_block
 	sbi->dmap_blkaddr = le32_to_cpu(raw_super->dmap_blkaddr);
 	sbi->inode_blkaddr = le32_to_cpu(raw_super->inodes_blkaddr);
 	sbi->data_blkaddr = le32_to_cpu(raw_super->data_blkaddr);
+	sbi->gdt_blkaddr = le32_to_cpu(raw_super->gdt_blkaddr);
 	sbi->blkcnt_imap = le32_to_cpu(raw_super->block_count_imap);
 	sbi->blkcnt_dmap = le32_to_cpu(raw_super->block_count_dmap);
 	sbi->blkcnt_inode = le32_to_cpu(raw_super->block_count_inodes);
 	sbi->blkcnt_data = le32_to_cpu(raw_super->block_count_data);
+	sbi->blkcnt_gdt = le32_to_cpu(raw_super->block_count_gdt);
 	sbi->total_blkcnt = le64_to_cpu(raw_super->block_count);
+
+	/* before packed inodes every inode had an inode-table block to itself */
+	sbi->inode_size = VSFS_BLKSIZE;
+	if (le16_to_cpu(raw_super->rev_level) > VSFS_CURRENT_REV) {
+		vsfs_msg(KERN_ERR, "vsfs_init_sb_info", "unsupported format revision %u",
+				le16_to_cpu(raw_super->rev_level));
+		return -EINVAL;
+	}
+	if (le16_to_cpu(raw_super->rev_level) >= VSFS_PACKED_REV) {
+		sbi->inode_size = le16_to_cpu(raw_super->inode_size);
+		if (sbi->inode_size < sizeof(struct vsfs_inode) ||
+				sbi->inode_size > VSFS_BLKSIZE || !is_power_of_2(sbi->inode_size)) {
+			vsfs_msg(KERN_ERR, "vsfs_init_sb_info", "bad inode size %u",
+					sbi->inode_size);
+			return -EINVAL;
+		}
+	}
+	sbi->inode_size_bits = ilog2(sbi->inode_size);
+	sbi->inodes_per_block_bits = VSFS_BLKSHIFT - sbi->inode_size_bits;
+	sbi->inodes_count = sbi->blkcnt_inode << sbi->inodes_per_block_bits;
+
+	/* images made before block groups: one group per dmap block, no table */
+	sbi->group_count = le32_to_cpu(raw_super->group_count);
+	if (!sbi->group_count) {
+		sbi->group_count = sbi->blkcnt_dmap;
+		sbi->gdt_blkaddr = 0;
+		sbi->blkcnt_gdt = 0;
+	}
+	if (sbi->group_count != sbi->blkcnt_dmap) {
+		vsfs_msg(KERN_ERR, "vsfs_init_sb_info", "group count %u does not match dmap size %u",
+				sbi->group_count, sbi->blkcnt_dmap);
+		return -EINVAL;
+	}
+
+	return vsfs_load_groups(sbi);
+}
+
+enum {
+	Opt_delalloc, Opt_nodelalloc, Opt_reservation, Opt_noreservation,
+	Opt_discard, Opt_nodiscard, Opt_inline_data, Opt_noinline_data,
+	Opt_extents, Opt_noextents, Opt_lazytime, Opt_nolazytime, Opt_err
+};
+
+static const match_table_t tokens = {
+	{Opt_delalloc, "delalloc"},
+	{Opt_nodelalloc, "nodelalloc"},
+	{Opt_reservation, "reservation"},
+	{Opt_noreservation, "noreservation"},
+	{Opt_discard, "discard"},
+	{Opt_nodiscard, "nodiscard"},
+	{Opt_inline_data, "inline_data"},
+	{Opt_noinline_data, "noinline_data"},
+	{Opt_extents, "extents"},
+	{Opt_noextents, "noextents"},
+	{Opt_lazytime, "lazytime"},
+	{Opt_nolazytime, "nolazytime"},
+	{Opt_err, NULL}
+};
+
+static int vsfs_parse_options(char *options, struct super_block *sb)
+{
+	struct vsfs_sb_info *sbi = VSFS_SB(sb);
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	int token;
+
+	if (!options)
+		return 1;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		token = match_token(p, tokens, args);
+		switch (token) {
+		case Opt_delalloc:
+			set_opt(sbi->s_mount_opt, DELALLOC);
+			break;
+		case Opt_nodelalloc:
+			clear_opt(sbi->s_mount_opt, DELALLOC);
+			break;
+		case Opt_reservation:
+			set_opt(sbi->s_mount_opt, RESERVATION);
+			break;
+		case Opt_noreservation:
+			clear_opt(sbi->s_mount_opt, RESERVATION);
+			break;
+		case Opt_discard:
+			set_opt(sbi->s_mount_opt, DISCARD);
+			break;
+		case Opt_nodiscard:
+			clear_opt(sbi->s_mount_opt, DISCARD);
+			break;
+		case Opt_inline_data:
+			set_opt(sbi->s_mount_opt, INLINE_DATA);
+			break;
+		case Opt_noinline_data:
+			clear_opt(sbi->s_mount_opt, INLINE_DATA);
+			break;
+		case Opt_extents:
+			set_opt(sbi->s_mount_opt, EXTENTS);
+			break;
+		case Opt_noextents:
+			clear_opt(sbi->s_mount_opt, EXTENTS);
+			break;
+		case Opt_lazytime:
+			sb->s_flags |= SB_LAZYTIME;
+			break;
+		case Opt_nolazytime:
+			sb->s_flags &= ~SB_LAZYTIME;
+			break;
+		default:
+			vsfs_msg(KERN_ERR, "vsfs_parse_options", "Unrecognized mount option \"%s\"", p);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int vsfs_show_options(struct seq_file *seq, struct dentry *root)
+{
+	struct super_block *sb = root->d_sb;
+
+	if (test_opt(sb, DELALLOC))
+		seq_puts(seq, ",delalloc");
+	if (!test_opt(sb, RESERVATION))
+		seq_puts(seq, ",noreservation");
+	if (test_opt(sb, DISCARD))
+		seq_puts(seq, ",discard");
+	if (!test_opt(sb, INLINE_DATA))
+		seq_puts(seq, ",noinline_data");
+	if (test_opt(sb, EXTENTS))
+		seq_puts(seq, ",extents");
+	return 0;
 }
 
 static int vsfs_fill_super(struct super_block *sb, void *data, int silent)
@@ -127,23 +543,56 @@ static int vsfs_fill_super(struct super_block *sb, void *data, int silent)
 	sb->s_op = &vsfs_sops;
 	sb->s_magic = le64_to_cpu(raw_super->magic);	
 
-	vsfs_init_sb_info(sbi, raw_super);
+	ret = vsfs_init_sb_info(sbi, raw_super);
+	if (ret) {
+		vsfs_msg(KERN_ERR, "vsfs_fill_super", "Failed to load block groups");
+		goto free_raw_super;
+	}
+
+	spin_lock_init(&sbi->rsv_window_lock);
+	sbi->rsv_window_root = RB_ROOT;
+
+	spin_lock_init(&sbi->discard_lock);
+	INIT_LIST_HEAD(&sbi->discard_list);
+	INIT_DELAYED_WORK(&sbi->discard_work, vsfs_discard_worker);
+
+	set_opt(sbi->s_mount_opt, RESERVATION);
+	set_opt(sbi->s_mount_opt, INLINE_DATA);
+	if (!vsfs_parse_options((char *)data, sb)) {
+		ret = -EINVAL;
+		goto free_groups;
+	}
+
+	if (test_opt(sb, DISCARD) && !blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+		vsfs_msg(KERN_WARNING, "vsfs_fill_super", "Device does not support discard, "
+				"mounting without it");
+		clear_opt(sbi->s_mount_opt, DISCARD);
+	}
 
 	//flag operation
 
 	root = vsfs_iget(sb, VSFS_ROOT_INO);
 	if (IS_ERR(root)) {
 		ret = PTR_ERR(root);
-		goto free_raw_super;
+		goto free_groups;
 	}
 	sb->s_root = d_make_root(root);
 	if (!sb->s_root) {
 		ret = -ENOMEM;
-		goto free_raw_super;
+		goto free_groups;
+	}
+
+	/* the table is only trusted again after a clean unmount */
+	if (!sb_rdonly(sb) && sbi->gdt_blkaddr) {
+		raw_super->state = cpu_to_le16(le16_to_cpu(raw_super->state) & ~VSFS_VALID_FS);
+		vsfs_commit_super(sb, 1);
 	}
 
 	return 0;
 
+free_groups:
+	vsfs_destroy_groups(sbi);
+
 free_raw_super:
 	kvfree(raw_super);
 
@@ -157,6 +606,18 @@ failed_nomem:
 	return -ENOMEM;
 }
 
+static int vsfs_sync_fs(struct super_block *sb, int wait)
+{
+	int err;
+
+	if (wait)
+		vsfs_flush_discards(sb);
+	vsfs_drain_ino_pools(sb);
+	err = vsfs_sync_bitmaps(sb, wait);
+	vsfs_commit_groups(sb, wait);
+	return err;
+}
+
 static struct kmem_cache *vsfs_inode_cachep;
 
 static struct inode *vsfs_alloc_inode(struct super_block *sb)
@@ -169,6 +630,18 @@ static struct inode *vsfs_alloc_inode(struct super_block *sb)
 
 	inode_set_iversion(&vsi->vfs_inode, 1);
 
+	vsi->i_reserved_data_blocks = 0;
+	vsi->i_reserved_meta_blocks = 0;
+	vsi->i_da_last_region = -1;
+	vsi->i_last_alloc_lblk = 0;
+	vsi->i_last_alloc_pblk = 0;
+	vsi->i_inline = 0;
+	vsi->i_flags = 0;
+	vsfs_map_cache_init(&vsi->vfs_inode);
+	RB_CLEAR_NODE(&vsi->i_rsv_window.rsv_node);
+	vsi->i_rsv_window.rsv_goal_size = VSFS_DEFAULT_RESERVE_BLOCKS;
+	vsi->i_rsv_window.rsv_alloc_hit = 0;
+
 	return &vsi->vfs_inode;
 }
 
@@ -181,6 +654,9 @@ static void init_once(void *foo)
 {
 	struct vsfs_inode_info *vsi = (struct vsfs_inode_info *) foo;
 
+	mutex_init(&vsi->truncate_mutex);
+	spin_lock_init(&vsi->i_block_reservation_lock);
+	spin_lock_init(&vsi->i_map_lock);
 	inode_init_once(&vsi->vfs_inode);
 }
 
@@ -208,7 +684,9 @@ static const struct super_operations vsfs_sops = {
 	.free_inode     = vsfs_free_inode,
 	.write_inode    = vsfs_write_inode,
 	.put_super      = vsfs_put_super,
+	.sync_fs	= vsfs_sync_fs,
 	.evict_inode    = vsfs_evict_inode,
+	.show_options	= vsfs_show_options,
 };
 
 static struct dentry *vsfs_mount(struct file_system_type *fs_type, int flags,
@@ -232,12 +710,22 @@ static int __init init_vsfs_fs(void)
 	err = init_inode_cache();
 	if (err)
 		goto out1;
-	err = register_filesystem(&vsfs_fs_type);
+	err = vsfs_init_fext_cache();
 	if (err)
 		goto out2;
+	err = vsfs_init_map_cache();
+	if (err)
+		goto out3;
+	err = register_filesystem(&vsfs_fs_type);
+	if (err)
+		goto out4;
 	
 	return 0;
 
+out4:
+	vsfs_destroy_map_cache();
+out3:
+	vsfs_destroy_fext_cache();
 out2:
 	destroy_inode_cache();
 
@@ -248,6 +736,8 @@ out1:
 static void __exit exit_vsfs_fs(void)
 {
 	unregister_filesystem(&vsfs_fs_type);
+	vsfs_destroy_map_cache();
+	vsfs_destroy_fext_cache();
 	destroy_inode_cache();
 }
 
@@ -9,37 +9,176 @@
 #ifndef _VSFS_H
 #define _VSFS_H
 
+#include <linux/percpu_counter.h>
+#include <linux/math64.h>
+#include <linux/rbtree.h>
+#include <linux/workqueue.h>
+#include <linux/fs.h>
+
 #include "vsfs_fs.h"
 
+/* a run of free bits in a group's data bitmap */
+struct vsfs_free_extent {
+	struct rb_node fe_node;				/* in fext_by_start */
+	struct rb_node fe_size_node;			/* in fext_by_size */
+	unsigned int fe_start;				/* first free bit */
+	unsigned int fe_len;
+};
+
+struct vsfs_group_info {
+	spinlock_t lock;				/* protects the group's bitmaps and counts */
+	unsigned int free_blocks;
+	unsigned int free_inodes;
+	unsigned int used_dirs;
+	unsigned long state;				/* VSFS_GRP_* bits */
+	struct rb_root fext_by_start;			/* free extents, with VSFS_GRP_FEXT_BUILT */
+	struct rb_root fext_by_size;
+};
+
+/* vsfs_group_info state bits */
+#define VSFS_GRP_DMAP_DIRTY		0	/* data bitmap not yet written back */
+#define VSFS_GRP_IMAP_DIRTY		1	/* inode bitmap not yet written back */
+#define VSFS_GRP_FEXT_BUILT		2	/* free extent index is valid */
+#define VSFS_GRP_TRIMMING		3	/* FITRIM owns the free runs */
+
+/*
+ * A reservation window: a range of data blocks an inode that keeps
+ * appending gets to allocate from before anybody else's window may take
+ * it.  Windows are in-memory only and do not keep allocations without
+ * one out of the range.
+ */
+struct vsfs_reserve_window {
+	struct rb_node rsv_node;			/* in sbi->rsv_window_root, by start */
+	unsigned int rsv_start;				/* first block of the window */
+	unsigned int rsv_end;				/* last block of the window */
+	unsigned int rsv_goal_size;			/* size of the next window */
+	unsigned int rsv_alloc_hit;			/* blocks taken from this window */
+};
+
+#define VSFS_DEFAULT_RESERVE_BLOCKS	8
+#define VSFS_MAX_RESERVE_BLOCKS		1024
+
+/* inode numbers a CPU has claimed from the imap but not handed out yet */
+#define VSFS_INO_POOL_SIZE		16
+
+struct vsfs_ino_pool {
+	spinlock_t lock;
+	unsigned int group;				/* where the numbers came from */
+	int nr;
+	ino_t ino[VSFS_INO_POOL_SIZE];
+};
+
+/* freed blocks waiting for their discard, see balloc.c */
+struct vsfs_discard_extent {
+	struct list_head list;
+	unsigned int start;
+	unsigned int len;
+};
+
+#define VSFS_DISCARD_DELAY		HZ
+
 struct vsfs_sb_info {
 	struct super_block *sb;				/* pointer to VFS super block */
 	struct vsfs_super_block *raw_super;		/* raw super block pointer */
 
-	unsigned int dmap_start_lookup;
-	unsigned int imap_start_lookup;
+	unsigned int dmap_start_lookup;			/* data bit to resume allocation at */
+	unsigned int imap_start_lookup;			/* inode bit to resume claiming at */
 
         unsigned int imap_blkaddr;
         unsigned int dmap_blkaddr;
         unsigned int data_blkaddr;
 	unsigned int inode_blkaddr;
+	unsigned int gdt_blkaddr;
         unsigned int blkcnt_imap;
         unsigned int blkcnt_dmap;
         unsigned int blkcnt_inode;
         unsigned int blkcnt_data;
+	unsigned int blkcnt_gdt;
 	unsigned long total_blkcnt;
+	unsigned int inodes_count;
+	unsigned int inode_size;			/* bytes per on-disk inode */
+	unsigned int inode_size_bits;
+	unsigned int inodes_per_block_bits;
+
+	unsigned int group_count;
+	struct vsfs_group_info *groups;			/* in-memory group descriptors */
+	struct percpu_counter free_blocks_counter;
+	struct percpu_counter free_inodes_counter;
+	struct percpu_counter dirs_counter;
+	struct percpu_counter dirty_blocks_counter;	/* promised to delayed allocation */
+	struct vsfs_ino_pool __percpu *ino_pools;
+
+	spinlock_t rsv_window_lock;			/* protects rsv_window_root */
+	struct rb_root rsv_window_root;
+
+	spinlock_t discard_lock;			/* protects discard_list */
+	struct list_head discard_list;
+	struct delayed_work discard_work;
+
+	unsigned int s_mount_opt;
 };
 
+/* mount options */
+#define VSFS_MOUNT_DELALLOC		0x0001
+#define VSFS_MOUNT_RESERVATION		0x0002
+#define VSFS_MOUNT_DISCARD		0x0004
+#define VSFS_MOUNT_INLINE_DATA		0x0008
+#define VSFS_MOUNT_EXTENTS		0x0010	/* new files map their blocks by extents */
+
+#define clear_opt(o, opt)		(o &= ~VSFS_MOUNT_##opt)
+#define set_opt(o, opt)			(o |= VSFS_MOUNT_##opt)
+#define test_opt(sb, opt)		(VSFS_SB(sb)->s_mount_opt & VSFS_MOUNT_##opt)
+
+/* vsfs_get_blocks() flags */
+#define VSFS_GET_BLOCKS_CREATE		0x0001
+#define VSFS_GET_BLOCKS_DELALLOC	0x0002	/* backed by a delalloc reservation */
+#define VSFS_GET_BLOCKS_UNWRITTEN	0x0004	/* preallocate, leave flagged unwritten */
+
+/* placeholder address of a delayed buffer, never submitted */
+#define VSFS_DELAYED_BLOCK		((sector_t)~0xffffUL)
+
 #define VSFS_GET_SB(i)			(sbi->i)
-#define vsfs_inotoba(x)			(((struct vsfs_sb_info *)(sb->s_fs_info))->inode_blkaddr + x - VSFS_ROOT_INO)
-#define VSFS_BITS_PER_BLK		BITS_PER_BYTE * VSFS_BLKSIZE
+#define vsfs_inotoba(x)			(VSFS_SB(sb)->inode_blkaddr + \
+					 (((x) - VSFS_ROOT_INO) >> VSFS_SB(sb)->inodes_per_block_bits))
+#define vsfs_inotoff(x)			((((x) - VSFS_ROOT_INO) & \
+					  ((1U << VSFS_SB(sb)->inodes_per_block_bits) - 1)) << \
+					 VSFS_SB(sb)->inode_size_bits)
+#define VSFS_BITS_PER_BLK		(BITS_PER_BYTE * VSFS_BLKSIZE)
 #define vsfs_max_bit(x)			(VSFS_BITS_PER_BLK * (x))
 
+/* indirect blocks read ahead along with one that has to come from disk */
+#define VSFS_IND_RA_BLOCKS		8
+
+/* most runs cached per inode */
+#define VSFS_MAP_CACHE_MAX		128
+
+/* below this many free blocks the per-cpu counters are summed exactly */
+#define VSFS_FREEBLOCKS_WATERMARK	(4 * (percpu_counter_batch * nr_cpu_ids))
+
 struct vsfs_inode_info {
 	__le32 i_data[15];
 	__u32 i_flags;
+	__u8 i_inline;					/* VSFS_INLINE_DATA_FL */
 
 	__u32 i_dir_start_lookup;
 
+	struct mutex truncate_mutex;			/* serializes block allocation and truncate */
+
+	spinlock_t i_block_reservation_lock;
+	unsigned int i_reserved_data_blocks;		/* delayed blocks not yet allocated */
+	unsigned int i_reserved_meta_blocks;		/* indirect blocks reserved for them */
+	long i_da_last_region;				/* leaf indirect region last reserved for */
+
+	sector_t i_last_alloc_lblk;			/* last logical block allocated */
+	unsigned int i_last_alloc_pblk;			/* and where it went, 0 if unknown */
+	struct vsfs_reserve_window i_rsv_window;	/* under truncate_mutex */
+
+	spinlock_t i_map_lock;				/* protects the i_map_* fields */
+	struct rb_root i_map_tree;			/* cached runs, see mapcache.c */
+	struct list_head i_map_lru;
+	unsigned int i_map_count;
+	unsigned int i_map_seq;				/* bumped whenever runs go away */
+
 	struct inode vfs_inode;
 };
 
@@ -53,19 +192,144 @@ static inline struct vsfs_sb_info *VSFS_SB(struct super_block *sb)
 	return sb->s_fs_info;
 }
 
+static inline struct vsfs_group_info *vsfs_get_group(struct vsfs_sb_info *sbi, unsigned int group)
+{
+	return &sbi->groups[group];
+}
+
+/* # of data blocks in a group; the last group is usually short */
+static inline unsigned int vsfs_group_data_bits(struct vsfs_sb_info *sbi, unsigned int group)
+{
+	unsigned long start = (unsigned long)group * VSFS_BITS_PER_BLK;
+
+	if (start >= sbi->blkcnt_data)
+		return 0;
+	return min_t(unsigned long, VSFS_BITS_PER_BLK, sbi->blkcnt_data - start);
+}
+
+/* # of inodes in a group; only the first blkcnt_imap groups have any */
+static inline unsigned int vsfs_group_inode_bits(struct vsfs_sb_info *sbi, unsigned int group)
+{
+	unsigned long start = (unsigned long)group * VSFS_BITS_PER_BLK;
+
+	if (group >= sbi->blkcnt_imap || start >= sbi->inodes_count)
+		return 0;
+	return min_t(unsigned long, VSFS_BITS_PER_BLK, sbi->inodes_count - start);
+}
+
+static inline unsigned int vsfs_ino_group(ino_t ino)
+{
+	return (ino - VSFS_ROOT_INO) / VSFS_BITS_PER_BLK;
+}
+
+/* data group the blocks of inode @ino start in, spreading inodes evenly over the data */
+static inline unsigned int vsfs_ino_data_group(struct vsfs_sb_info *sbi, ino_t ino)
+{
+	return div_u64((u64)(ino - VSFS_ROOT_INO) * sbi->group_count, sbi->inodes_count);
+}
+
+/* bytes of file data an inode slot holds in place of its block pointers */
+static inline unsigned int vsfs_inline_size(struct super_block *sb)
+{
+	return VSFS_SB(sb)->inode_size - offsetof(struct vsfs_inode, i_daddr);
+}
+
+static inline int vsfs_has_inline_data(struct inode *inode)
+{
+	return VSFS_I(inode)->i_inline & VSFS_INLINE_DATA_FL;
+}
+
+/* regular files use iomap, except with delalloc which needs buffer_heads */
+static inline bool vsfs_use_iomap(struct inode *inode)
+{
+	return S_ISREG(inode->i_mode) && !test_opt(inode->i_sb, DELALLOC);
+}
+
+static inline int vsfs_has_extents(struct inode *inode)
+{
+	return VSFS_I(inode)->i_flags & VSFS_EXTENTS_FL;
+}
+
+/* a run of vsfs_free_batch_add() calls sharing bitmap block writes */
+struct vsfs_free_batch {
+	struct super_block *sb;
+	struct inode *inode;
+	struct buffer_head *bitmap_bh;			/* bitmap of the group below */
+	unsigned int group;
+	unsigned long freed;				/* blocks to take off i_blocks */
+};
+
 /* super.c */
 extern void vsfs_msg(const char *, const char *, const char *, ...);
+extern void vsfs_commit_groups(struct super_block *, int);
+extern int vsfs_sync_bitmaps(struct super_block *, int);
+
+/* balloc.c */
+extern unsigned int vsfs_new_blocks(struct super_block *, struct vsfs_reserve_window *,
+		unsigned int, unsigned long *, int *);
+extern void vsfs_discard_reservation(struct inode *);
+extern void vsfs_free_blocks(struct inode *, unsigned int, unsigned int);
+extern void vsfs_free_batch_init(struct vsfs_free_batch *, struct super_block *, struct inode *);
+extern void vsfs_free_batch_add(struct vsfs_free_batch *, unsigned int, unsigned int);
+extern void vsfs_free_batch_end(struct vsfs_free_batch *);
+extern void vsfs_drop_free_extents(struct vsfs_sb_info *);
+extern int vsfs_init_fext_cache(void);
+extern void vsfs_destroy_fext_cache(void);
+extern void vsfs_discard_worker(struct work_struct *);
+extern bool vsfs_flush_discards(struct super_block *);
+extern int vsfs_trim_fs(struct super_block *, struct fstrim_range *);
+extern unsigned long vsfs_count_free_blocks(struct super_block *);
+extern int vsfs_reserve_blocks(struct super_block *, unsigned long);
+extern void vsfs_release_blocks(struct super_block *, unsigned long);
+
+/* ialloc.c */
+extern ino_t vsfs_new_ino(struct inode *, umode_t, int *);
+extern void vsfs_free_ino(struct inode *);
+extern void vsfs_drain_ino_pools(struct super_block *);
 
 /* inode.c */
 extern struct inode *vsfs_iget(struct super_block *, unsigned long);
 extern int vsfs_write_inode(struct inode *, struct writeback_control *);
 extern void vsfs_evict_inode(struct inode *);
+extern int vsfs_get_block(struct inode *, sector_t, struct buffer_head *, int);
 extern int vsfs_prepare_chunk(struct page *, loff_t, unsigned);
 extern struct inode *vsfs_new_inode(struct inode *, umode_t);
 extern int vsfs_setattr(struct dentry *, struct iattr *);
+extern int vsfs_fsync(struct file *, loff_t, loff_t, int);
 extern const struct inode_operations vsfs_file_inode_operations;
 extern const struct file_operations vsfs_file_operations;
 extern const struct address_space_operations vsfs_aops;
+extern const struct address_space_operations vsfs_iomap_aops;
+extern const struct iomap_ops vsfs_iomap_ops;
+
+/* inline.c */
+extern int vsfs_read_inline(struct inode *, void *, unsigned int, unsigned int);
+extern int vsfs_write_inline(struct inode *, const void *, unsigned int, unsigned int);
+extern int vsfs_readpage_inline(struct inode *, struct page *);
+extern int vsfs_writepage_inline(struct page *);
+extern int vsfs_write_inline_begin(struct address_space *, unsigned int, struct page **);
+extern int vsfs_write_inline_end(struct inode *, loff_t, unsigned int, struct page *);
+extern int vsfs_convert_inline(struct inode *, get_block_t *);
+
+/* extents.c */
+extern void vsfs_ext_tree_init(struct inode *);
+extern int vsfs_ext_get_blocks(struct inode *, sector_t, unsigned long, u32 *, bool *, bool *,
+		int, unsigned int *);
+extern int vsfs_ext_remove_space(struct inode *, u32, u32, struct vsfs_free_batch *);
+extern unsigned long vsfs_ext_hole_len(struct inode *, sector_t, unsigned long);
+
+/* mapcache.c */
+extern void vsfs_map_cache_init(struct inode *);
+extern unsigned int vsfs_map_cache_seq(struct inode *);
+extern int vsfs_map_cache_lookup(struct inode *, sector_t, unsigned long, u32 *);
+extern void vsfs_map_cache_insert(struct inode *, unsigned int, sector_t, unsigned int,
+		unsigned int);
+extern void vsfs_map_cache_remove(struct inode *, sector_t, sector_t);
+extern int vsfs_init_map_cache(void);
+extern void vsfs_destroy_map_cache(void);
+
+/* ioctl.c */
+extern long vsfs_ioctl(struct file *, unsigned int, unsigned long);
 
 /* dir.c */
 extern int vsfs_add_link(struct dentry *, struct inode *);
@@ -28,6 +28,7 @@ struct vsfs_configuration {
 	u_int64_t end_blkaddr;
 	u_int64_t total_sectors;
 	u_int32_t total_blocks;
+	u_int32_t inode_size;
 
 	char *vol_label;
 	char *path;
@@ -88,8 +89,36 @@ struct vsfs_super_block {
         __le32 block_count_data;        /* # of blocks for data */
         __le32 root_addr;               /* root inode blkaddr */
 	char path[MAX_PATH_LEN];
+        __le32 gdt_blkaddr;             /* start block address of group descriptors */
+        __le32 block_count_gdt;         /* # of blocks for group descriptors */
+        __le32 group_count;             /* # of block groups, 0 on old images */
+        __le16 state;                   /* file system state */
+        __le16 rev_level;               /* on-disk format revision */
+        __le16 inode_size;              /* bytes per on-disk inode, VSFS_PACKED_REV on */
 } __attribute__((packed));
 
+#define VSFS_VALID_FS			0x0001	/* cleanly unmounted */
+
+#define VSFS_OLD_REV			0	/* one inode per inode-table block */
+#define VSFS_PACKED_REV			1	/* inode_size bytes per inode */
+#define VSFS_CURRENT_REV		VSFS_PACKED_REV
+#define VSFS_DEF_INODE_SIZE		256
+
+/*
+ * Group g owns dmap block g, the data blocks it describes and, while
+ * g < block_count_imap, imap block g with the inodes it describes.
+ */
+struct vsfs_group_desc {
+        __le32 dmap_blkaddr;            /* block address of the group's data bmap */
+        __le32 imap_blkaddr;            /* block address of the group's inode bmap, 0 if none */
+        __le32 free_blocks_count;       /* # of free data blocks */
+        __le32 free_inodes_count;       /* # of free inodes */
+        __le32 used_dirs_count;         /* # of directories */
+        __le32 reserved[3];
+} __attribute__((packed));
+
+#define VSFS_DESC_PER_BLK		(VSFS_BLKSIZE / sizeof(struct vsfs_group_desc))
+
 #define VSFS_DIR_BLK_CNT		12      /* Address Pointers in Inode */
 #define VSFS_IND_BLK_CNT		3       /* Indirect Pointers in Inode */
 #define VSFS_NODE_PER_BLK		1024    /* Address Pointers in an Indirect Block */
@@ -98,6 +127,47 @@ struct vsfs_super_block {
 #define VSFS_DIND_BLK			VSFS_DIR_BLK_CNT + 1
 #define VSFS_TIND_BLK			VSFS_DIR_BLK_CNT + 2
 
+/* set in a data block pointer allocated by fallocate and not written yet */
+#define VSFS_UNWRITTEN_FLAG		0x80000000U
+
+/* i_inline flags */
+#define VSFS_INLINE_DATA_FL		0x01	/* contents live in the inode slot from i_daddr on */
+
+/* i_flags */
+#define VSFS_EXTENTS_FL			0x00080000	/* blocks mapped by an extent tree */
+
+/*
+ * Extent tree, rooted in i_daddr/i_iaddr of an inode with VSFS_EXTENTS_FL.
+ * Every node opens with a header; leaves hold extents, the levels above
+ * them indexes keyed by the first block below.
+ */
+struct vsfs_extent_header {
+        __le16 eh_magic;                /* VSFS_EXT_MAGIC */
+        __le16 eh_entries;              /* # of valid entries */
+        __le16 eh_max;                  /* capacity of the node */
+        __le16 eh_depth;                /* 0 for a leaf */
+} __attribute__((packed));
+
+struct vsfs_extent {
+        __le32 ee_block;                /* first logical block */
+        __le32 ee_len;                  /* # of blocks, VSFS_UNWRITTEN_FLAG if preallocated */
+        __le32 ee_start;                /* first physical block */
+} __attribute__((packed));
+
+struct vsfs_extent_idx {
+        __le32 ei_block;                /* first logical block below */
+        __le32 ei_leaf;                 /* block of the node below */
+        __le32 ei_unused;
+} __attribute__((packed));
+
+#define VSFS_EXT_MAGIC			0xf5e1
+#define VSFS_EXT_ROOT_MAX		4	/* entries in i_daddr/i_iaddr */
+#define VSFS_EXT_NODE_MAX		((VSFS_BLKSIZE - sizeof(struct vsfs_extent_header)) / \
+					 sizeof(struct vsfs_extent))
+#define VSFS_EXT_MAX_DEPTH		5
+#define VSFS_EXT_MAX_LEN		(VSFS_UNWRITTEN_FLAG - 1)
+#define VSFS_EXT_MAX_BLOCKS		0xffffffffU
+
 #define VSFS_MAXNAME_LEN		255
 
 struct vsfs_inode {